@@ -11,7 +11,13 @@
  *
  * See README.txt for more information. 
  * 
- * Space requirements: 6 bytes + 8 per command + buffer size
+ * Space requirements on AVR, with the default options and a buffer of up to
+ * 255 chars: 16 bytes + 8 per command + (buffer size + 11) * queue size. The
+ * 16 bytes include the CRC of the keyword being received, and each queue slot
+ * holds a command's chars, its terminator and 10 bytes about it (position,
+ * length, error, keyword hash and index). Longer buffers need 2 bytes more
+ * per slot and 2 more in total, and options such as
+ * COMMAND_INCREMENTAL_PARSING add to each slot.
  */
 
  #pragma once
@@ -19,10 +25,83 @@
 #include <Arduino.h>
 
 #include "compileTimeCRC32.h"
+#include "runtimeCrc32.h"
+#include "hashScan.h"
+#include "scpiTree.h"
+#include "commandResponse.h"
 #include "Microprocessor_Debugging\debugging_disable.h"
 
-#define COMMAND_SIZE_MAX 150 // num chars to reserve in memory for buffer
+// Default num chars to reserve in memory for each command. Each handler can
+// be given its own size instead, as a template argument (see
+// BasicCommandHandler)
+#ifndef COMMAND_SIZE_MAX
+#define COMMAND_SIZE_MAX 150
+#endif
+
 #define EEPROM_SIZE_MAX 256 // Max space used in EEPROM
+#define COMMAND_POLL_CHUNK_SIZE 64 // num chars read from a Stream at once by `poll()`
+
+// Number of parameters (including the command itself) whose positions are
+// stored by ParameterLookup. Parameters beyond this can still be accessed,
+// but are found by searching the string
+#ifndef COMMAND_PARAMS_MAX
+#define COMMAND_PARAMS_MAX 16
+#endif
+
+// To split commands into parameters as chars are received, instead of when
+// the command is executed, set this flag:
+// #define COMMAND_INCREMENTAL_PARSING
+
+// To look up SCPI headers such as ":SOURce:VOLTage" in a tree of commands
+// (see scpiTree.h) and to split lines into several commands at ';' chars, set
+// this flag:
+// #define COMMAND_SCPI_TREE
+
+// To receive IEEE 488.2 definite length blocks of binary data as parameters,
+// e.g. "DATA #15hello", set this flag (see `setBlockBuffer()`):
+// #define COMMAND_BLOCK_PARAMETERS
+
+// To allow commands whose parameters are passed to a function one at a time as
+// they arrive, so that they can be longer than the input buffer (see
+// `registerStreamingCommand()`), set this flag:
+// #define COMMAND_STREAMING
+
+// To collect the replies of commands in a buffer and write them out once
+// each line of commands has ended (see commandResponse.h), set this flag:
+// #define COMMAND_RESPONSES
+
+// To also pass replies through a ring of COMMAND_TRANSMIT_SIZE chars, so that
+// commands never wait for the output (see `service()`), set this flag. It
+// implies COMMAND_RESPONSES:
+// #define COMMAND_TRANSMIT_RING
+
+#if defined(COMMAND_TRANSMIT_RING) && !defined(COMMAND_RESPONSES)
+#define COMMAND_RESPONSES
+#endif
+
+// To receive chars in an interrupt, e.g. from a UART, and execute the commands
+// in the main loop (see `addCommandCharFromISR()`), set this flag:
+// #define COMMAND_ISR_RECEIVE
+
+#ifdef COMMAND_ISR_RECEIVE
+// num chars to reserve in memory for chars received in an interrupt. Commands
+// longer than this are dropped. At most 256
+#ifndef COMMAND_RECEIVE_SIZE
+#define COMMAND_RECEIVE_SIZE (COMMAND_SIZE_MAX + 1)
+#endif
+#endif
+
+#ifdef COMMAND_STREAMING
+// Number of streaming commands which can be registered
+#ifndef COMMAND_STREAMING_MAX
+#define COMMAND_STREAMING_MAX 4
+#endif
+
+// num chars to reserve in memory for each parameter of a streaming command
+#ifndef COMMAND_STREAM_PARAM_MAX
+#define COMMAND_STREAM_PARAM_MAX 32
+#endif
+#endif
 
 // To disable EEPROM features, set this flag:
 // #define EEPROM_DISABLED
@@ -47,98 +126,211 @@ enum class CommandHandlerReturn {
 	BUFFER_FULL,
 	COMMAND_TOO_LONG,
 	EEPROM_FULL,
+	COMMAND_ALREADY_REGISTERED,
+	INVALID_PARAMETER,
 	UNKNOWN_ERROR
 };
 
+// Selects the smallest unsigned type which can index a buffer of `size` chars,
+// e.g. `BufferIndex<150>::type` is a uint8_t for buffers of up to 255 chars
+template <size_t size, bool fitsInByte = (size <= 0xFF), bool fitsInWord = (size <= 0xFFFF)>
+struct BufferIndex { typedef size_t type; };
+
+template <size_t size, bool fitsInWord>
+struct BufferIndex<size, true, fitsInWord> { typedef uint8_t type; };
+
+template <size_t size>
+struct BufferIndex<size, false, true> { typedef uint16_t type; };
+
+//////////////////////  PARAMETER TABLE  //////////////////////
+
+// This struct records where the parameters are in a command string. It is
+// built one char at a time by `addChar()`, either by ParameterLookup or, if
+// COMMAND_INCREMENTAL_PARSING is set, by CommandHandler as the chars arrive.
+//
+// The position and length of the first COMMAND_PARAMS_MAX parameters are
+// stored. Later parameters are counted but must be found by searching. They
+// are stored in the smallest type which can index a command of `buffer_size`
+// chars.
+template <size_t buffer_size>
+struct BasicParameterTable {
+
+	// Type used to store positions within a command
+	typedef typename BufferIndex<buffer_size>::type index_t;
+
+	// Is this char a delimiter between parameters?
+	static bool isDelimiter(const char c) { return ' ' == c || '\t' == c; }
+
+	// Reset to describe an empty string
+	void clear() {
+		length = 0;
+		size = 0;
+		inParam = false;
+	}
+
+	// Add the next char of the command to the table
+	void addChar(const char c) {
+
+		if (isDelimiter(c)) {
+			inParam = false;
+		}
+		else {
+			if (!inParam) {
+
+				// This is the first char of a new param, so record its
+				// position and increment the param count
+				if (size < COMMAND_PARAMS_MAX) {
+					offsets[size] = length;
+					lengths[size] = 0;
+				}
+
+				size++;
+				inParam = true;
+			}
+
+			if (size <= COMMAND_PARAMS_MAX) {
+				lengths[size - 1]++;
+			}
+		}
+
+		length++;
+	}
+
+	index_t length; // Length of the whole command
+	index_t size; // Number of params, including the command itself
+	bool inParam; // True if the last char added was part of a param
+
+	// Position and length of the first COMMAND_PARAMS_MAX params
+	index_t offsets[COMMAND_PARAMS_MAX];
+	index_t lengths[COMMAND_PARAMS_MAX];
+};
+
+// The table for commands of the default size, COMMAND_SIZE_MAX
+typedef BasicParameterTable<COMMAND_SIZE_MAX> ParameterTable;
+
 //////////////////////  PARAMETER LOOKUP  //////////////////////
 
-// This class handles the lookup of parameters from an internal string It stores
-// an internal pointer to a string which will be invalidated and should not be
-// used by other code after passing to this object.
+// This class handles the lookup of parameters from a command string. It stores
+// an internal pointer to the string, which must remain valid and unchanged for
+// the lifetime of this object.
 //
 // Index it (e.g. "lookup[0]") to get a parameter out, starting with 0 being the
 // command itself.
 //
-// The special index e.g. "lookup[-1]" returns the whole command string, with
-// spaces seperating parameters.
+// The special index e.g. "lookup[-1]" returns the whole command string, exactly
+// as it was received, and "lookup[-2]" returns all the parameters.
 //
 // Implementation --------------
 //
-// This object is implemented entirely on the stack. Namely, it splits
-// `_theCommand` into several strings, so the whole thing contains several NULL
-// chars delimiting each parameter.
+// This object is implemented entirely on the stack. Commands are given a
+// ParameterLookup, but the object itself is a BasicParameterLookup<size>,
+// which holds the storage for a command of up to <size> chars. Its constructor
+// scans `_theCommand` once, recording the position and length of the first
+// COMMAND_PARAMS_MAX parameters in a BasicParameterTable. If the table was
+// already built while the command was received, it is passed in and no scan
+// is needed. `_theCommand` itself is never modified, so "lookup[-1]" and
+// "lookup[-2]" are just pointers into it.
 //
-// After the Constuctor is called, `_theCommand` would be as shown for the
-// command "HELO 1 2 3.3" :
+// The first time a parameter is indexed, `_theCommand` is copied into
+// `_tokens` with a NULL char after each parameter. For the command
+// "HELO 1 2 3.3" the copy would be:
 //
 // "HELO[0x00]1[0x00]2[0x00]3.3[0x00]"
 // 
-// The private member char* _endOfString would point to the final NULL char. 
-//
-// Thus pointers can be passed to the beginning of each required parameter and
-// they form valid c strings for other functions to use.
+// Parameters are at the same positions in both strings, so the table serves
+// for both. Thus pointers can be passed to the beginning of each required
+// parameter and they form valid c strings for other functions to use, while
+// the whole string remains available too.
 class ParameterLookup {
 
 public:
 
-	// Constuctor.
-	// Replace spaces in commandStr with NULL
-	// The buffer pointed to by commandStr must be at least COMMAND_SIZE_MAX in length
-	ParameterLookup(char * commandStr) :
-		_theCommand(commandStr), _stringHasNULLS(false)
-	{
-		CONSOLE_LOG(F("ParameterLookup::Constuctor with command: "));
-		CONSOLE_LOG_LN(commandStr);
-
-		subSpacesForNULL();
-	}
-
 	// Get parameter indexed. Parameter 0 is the command itself
 	// Paremeter -1 returns the entire string
 	// Paremeter -2 returns all the parameters
 	// Requesting a non-existent parameter will return a NULL ptr
 	const char* operator[](int idx) const {
-		// This is a const method, so I'm not allowed to modify the object. However,
-		// I want to. I know that these modifications don't change the object in a
-		// relevant way, so this is a const method "in spirit". To force the
-		// compiler to accept this, I cast away the const-ness of our pointer.
-		ParameterLookup* this_mutable = const_cast<ParameterLookup*>(this);
 
 		if (idx == -1) {
-			// The user wants the whole string.
-			// OK, replace all the NULLs with spaces and then return a pointer
-			// to the start of the string
-
-			if (_stringHasNULLS) this_mutable->restoreSpaces();
-
+			// The user wants the whole string, which we never modify
 			return _theCommand;
 
 		} else if (idx == -2) {
-			// The user wants all the parameters
-			// Find a pointer to the first param then restore all the spaces and
-			// return it
-
-			char* ptr = this_mutable->getParamPtr(1);
+			// The user wants all the parameters, which run from the start of
+			// the first one to the end of the string
 
-			this_mutable->restoreSpaces();
+			if (_size < 2) return 0;
 
-			return ptr;
+			return _theCommand + paramOffset(1);
 
 		} else {
-			// The user wants a particular parameter. Ensure the string si setup
-			// correctly, then loop through to return a pointer to the start of the
-			// appropriate param
+			// The user wants a particular parameter. Ensure the NULL separated
+			// copy exists, then return a pointer to the parameter in it
 
-			if (!_stringHasNULLS) this_mutable->subSpacesForNULL();
+			if (idx < 0 || (unsigned int)idx >= _size) return 0;
 
-			return this_mutable->getParamPtr(idx);
+			if (!_hasTokens) makeTokens();
+
+			return _tokens + paramOffset(idx);
 		}
 	}
 
 	// Number of stored params, including the command itself
 	unsigned int size() const { return _size; }
 
-	// Dump the contents of _theCommand if in debug mode
+	// Length of a parameter, not including the NULL terminator. Requesting a
+	// non-existent parameter returns 0
+	unsigned int length(int idx) const {
+
+		if (idx < 0 || (unsigned int)idx >= _size)
+			return 0;
+
+		if (idx < COMMAND_PARAMS_MAX)
+			return storedLength(idx);
+
+		return paramLength(_theCommand + paramOffset(idx));
+	}
+
+	// Report that the command failed, e.g. because a parameter was not a valid
+	// number. `executeCommand()` returns this error once the command's function
+	// has returned
+	void setError(CommandHandlerReturn error) const { _error = error; }
+
+	// The error reported by `setError()`, or NO_ERROR
+	CommandHandlerReturn error() const { return _error; }
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+	// Attach the payload of a block parameter to this command. `data` is
+	// NULL if the payload was passed to a blockFunction instead of being
+	// stored, and `length` is -1 if the command had no block
+	void setBlock(const char* data, long length) {
+		_block = data;
+		_blockLength = length;
+	}
+
+	// Did the command include a block parameter?
+	bool hasBlock() const { return _blockLength >= 0; }
+
+	// The payload of the block parameter, which is not null terminated and
+	// may contain any bytes. The parameter itself, e.g. "#3100", holds only
+	// the block's header
+	const char* block() const { return _block; }
+
+	// Length of the block's payload, or 0 if there wasn't one
+	size_t blockLength() const { return hasBlock() ? _blockLength : 0; }
+#endif
+
+#ifdef COMMAND_RESPONSES
+	// Set the buffer for the command's reply
+	void setResponse(CommandResponse* response) { _response = response; }
+
+	// The buffer for the command's reply, e.g.
+	// 		params.response().printFloat(volts, 3);
+	// This is only valid when the command is called by `executeCommand()`
+	CommandResponse& response() const { return *_response; }
+#endif
+
+	// Dump the contents of _tokens if in debug mode
 	void dump() const {
 
 		CONSOLE_LOG_LN(F("ParameterLookup::dump"));
@@ -147,25 +339,27 @@ public:
 
 		if (!__serial_is_ready) return;
 
+		if (!_hasTokens) makeTokens();
+
 		Serial.print(F("*** loc ("));
 		Serial.print((int)_theCommand, DEC);
 		Serial.println(F(") ***"));
 
-		for (int i = 0; i < COMMAND_SIZE_MAX; i++) {
+		for (unsigned int i = 0; i <= _length; i++) {
 			Serial.print(i);
 			Serial.print('\t');
 		}
 
 		Serial.println("");
 
-		for (int i = 0; i < COMMAND_SIZE_MAX; i++) {
-			if (isprint(_theCommand[i]))
+		for (unsigned int i = 0; i <= _length; i++) {
+			if (isprint(_tokens[i]))
 			{
-				Serial.print(_theCommand[i]);
+				Serial.print(_tokens[i]);
 			}
 			else {
 				Serial.print('[');
-				Serial.print((int)_theCommand[i]);
+				Serial.print((int)_tokens[i]);
 				Serial.print(']');
 			}
 			Serial.print('\t');
@@ -176,141 +370,704 @@ public:
 #endif
 	}
 
+protected:
+
+	// Constuctor, for BasicParameterLookup. `tokens` must have room for a
+	// copy of commandStr, including its null terminator
+	ParameterLookup(const char * commandStr, char * tokens) :
+		_theCommand(commandStr), _tokens(tokens), _size(0), _length(0),
+		_offsets(NULL), _lengths(NULL), _indexSize(1),
+		_hasTokens(false), _error(CommandHandlerReturn::NO_ERROR)
+	{
+#ifdef COMMAND_BLOCK_PARAMETERS
+		setBlock(NULL, -1);
+#endif
+
+#ifdef COMMAND_RESPONSES
+		_response = NULL;
+#endif
+	}
+
+	// `_tokens` points into the object being copied, so copies aren't allowed
+	ParameterLookup(const ParameterLookup&) = delete;
+	ParameterLookup& operator=(const ParameterLookup&) = delete;
+
+	// Point to the table of params once it has been built
+	template <size_t buffer_size>
+	void setTable(const BasicParameterTable<buffer_size>& table) {
+		_size = table.size;
+		_length = table.length;
+		_offsets = table.offsets;
+		_lengths = table.lengths;
+		_indexSize = sizeof(typename BasicParameterTable<buffer_size>::index_t);
+	}
+
 private:
 
+	// Read entry `idx` of the table's offsets or lengths, whose size depends
+	// on the size of the buffer
+	unsigned int tableEntry(const void * array, int idx) const {
+
+		if (_indexSize == 1) return ((const uint8_t *)array)[idx];
+		if (_indexSize == 2) return ((const uint16_t *)array)[idx];
+
+		return ((const size_t *)array)[idx];
+	}
+
+	// Position and length of one of the first COMMAND_PARAMS_MAX params
+	unsigned int storedOffset(int idx) const { return tableEntry(_offsets, idx); }
+	unsigned int storedLength(int idx) const { return tableEntry(_lengths, idx); }
+
+	// Length of the parameter starting at `param`
+	static unsigned int paramLength(const char * param) {
+
+		const char * end = param;
+		while (*end && !ParameterTable::isDelimiter(*end)) end++;
+
+		return end - param;
+	}
+
 	/**
-	 * @brief      Gets a pointer to the start of a given parameter
+	 * @brief      Gets the position of a given parameter in `_theCommand`
 	 *
-	 *             This function requires that the command `_theCommand` is
-	 *             formatted with NULLs. If it isn't, this function will format
-	 *             it.
+	 *             Positions of the first COMMAND_PARAMS_MAX parameters are
+	 *             looked up in the table. Later ones are found by searching on
+	 *             from the last parameter in the table.
 	 *
-	 * @param[in]  idx   The parameter index
+	 * @param[in]  idx   The parameter index, which must exist
 	 *
-	 * @return     The parameter pointer.
+	 * @return     The parameter's offset from the start of the string
 	 */
-	char * getParamPtr(int idx) {
-		
-		if (!_stringHasNULLS)
-			subSpacesForNULL();
+	unsigned int paramOffset(int idx) const {
 
-		CONSOLE_LOG(F("ParameterLookup::Looking for param "));
+		if (idx < COMMAND_PARAMS_MAX)
+			return storedOffset(idx);
+
+		CONSOLE_LOG(F("ParameterLookup::Searching for param "));
 		CONSOLE_LOG_LN(idx);
 
-		char * paramPtr = _theCommand;
-		int count = idx;
+		const char * paramPtr = _theCommand + storedOffset(COMMAND_PARAMS_MAX - 1);
+		int count = idx - (COMMAND_PARAMS_MAX - 1);
+
+		while (count > 0) {
 
-		// `_theCommand` ends at `_endOfString`, so don't go past this
-		while (paramPtr < _endOfString) {
+			// Skip this parameter, then the delimiters after it
+			paramPtr += paramLength(paramPtr);
+			while (ParameterTable::isDelimiter(*paramPtr)) paramPtr++;
 
-			if (count == 0 && *paramPtr) {
-				// We found a non null char after passing the required 
-				// number of nulls, so return a pointer to it
+			count--;
+		}
 
-				CONSOLE_LOG(F("ParameterLookup::Returning ptr to pos "));
-				CONSOLE_LOG(paramPtr - _theCommand);
-				CONSOLE_LOG(F(", containing command: "));
-				CONSOLE_LOG_LN(paramPtr);
+		return paramPtr - _theCommand;
+	}
 
-				return paramPtr;
-			}
+	// Copy _theCommand into _tokens, replacing spaces and tabs with NULLs.
+	// This is const since it only fills a cache: the parameters seen by the
+	// user are unchanged
+	void makeTokens() const {
 
-			if ('\0' == *paramPtr && // We found a null...
-									 // ... and the previous char wasn't a null
-				paramPtr > _theCommand && '\0' != *(paramPtr - 1)) {
-				// Decrement the count, as we've passed a delimiter
-				count--;
+		for (unsigned int i = 0; i <= _length; i++) {
 
-				CONSOLE_LOG(F("ParameterLookup::Break found at pos "));
-				CONSOLE_LOG_LN(paramPtr - _theCommand);
-			}
+			const char c = _theCommand[i];
 
-			// Next char
-			paramPtr++;
+			_tokens[i] = ParameterTable::isDelimiter(c) ? '\0' : c;
 		}
 
-		// We hit the end of the string. Return a NULL pointer
-		return 0;
+		_hasTokens = true;
 	}
 
+	// Pointer to the whole command
+	const char * _theCommand;
 
-	// Loop through _theCommand counting params and subbing out
-	// spaces or tabs for NULLs
-	void subSpacesForNULL() {
+	// Copy of _theCommand split into parameters by NULLs, made when needed.
+	// The storage belongs to the BasicParameterLookup
+	char * const _tokens;
 
-		char * loop = _theCommand;
-		_size = 1;
+	// Number of params and length of _theCommand
+	unsigned int _size;
+	unsigned int _length;
 
-		while (*loop) {
+	// The positions and lengths of the params in the table, which belongs
+	// to the BasicParameterLookup. Each entry is `_indexSize` bytes
+	const void * _offsets;
+	const void * _lengths;
+	uint8_t _indexSize;
 
-			if (' ' == *loop || '\t' == *loop) {
+	mutable bool _hasTokens;
 
-				CONSOLE_LOG(F("ParameterLookup::Replacing char '"));
-				CONSOLE_LOG(*loop);
-				CONSOLE_LOG(F("' at pos "));
-				CONSOLE_LOG(loop - _theCommand);
-				CONSOLE_LOG_LN(F(" with \\0"));
+	// Error reported by the command's function
+	mutable CommandHandlerReturn _error;
 
-				// Replace spaces with NULL chars
-				*loop = '\0';
+#ifdef COMMAND_BLOCK_PARAMETERS
+	// Payload of the command's block parameter
+	const char* _block;
+	long _blockLength;
+#endif
 
-				// If the preceeding char wasn't also a space,
-				// increment the param count
-				if (loop > _theCommand && // Don't look too far back!
-					'\0' != *(loop - sizeof(char))) {
-					_size++;
-				}
+#ifdef COMMAND_RESPONSES
+	// Buffer for the command's reply
+	CommandResponse* _response;
+#endif
+
+};
+
+// A ParameterLookup for commands shorter than `buffer_size` chars, which
+// holds the table of their params and the copy which is split into
+// parameters
+template <size_t buffer_size>
+class BasicParameterLookup : public ParameterLookup {
+
+public:
+
+	typedef BasicParameterTable<buffer_size> Table;
+
+	// Constuctor.
+	// Find the parameters in commandStr
+	// commandStr must be a null terminated string shorter than buffer_size
+	explicit BasicParameterLookup(const char * commandStr) :
+		ParameterLookup(commandStr, _storage)
+	{
+		CONSOLE_LOG(F("ParameterLookup::Constuctor with command: "));
+		CONSOLE_LOG_LN(commandStr);
+
+		findParams();
+	}
+
+	// Constuctor.
+	// Use an existing table of the parameters in commandStr
+	BasicParameterLookup(const char * commandStr, const Table& params) :
+		ParameterLookup(commandStr, _storage), _params(params)
+	{
+		CONSOLE_LOG(F("ParameterLookup::Constuctor with parsed command: "));
+		CONSOLE_LOG_LN(commandStr);
+
+		setTable(_params);
+	}
+
+private:
+
+	// Loop through the command counting params and storing the positions of
+	// the first COMMAND_PARAMS_MAX of them
+	void findParams() {
+
+		_params.clear();
+
+		for (const char * loop = (*this)[-1]; *loop; loop++) {
+			_params.addChar(*loop);
+		}
+
+		setTable(_params);
+
+		CONSOLE_LOG(F("ParameterLookup::_theCommand has length "));
+		CONSOLE_LOG_LN(_params.length);
+	}
+
+	// Positions of the params in the command
+	Table _params;
+
+	// Storage for the ParameterLookup's `_tokens`
+	char _storage[buffer_size + 1];
+};
+
+// The lookup for commands of the default size, COMMAND_SIZE_MAX. Build one of
+// these to call a command directly, e.g. StringParameterLookup params("volt 1.5")
+typedef BasicParameterLookup<COMMAND_SIZE_MAX> StringParameterLookup;
+
+// Template for the functions to be called in response to a command
+typedef void commandFunction(const ParameterLookup& params);
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+// Template for functions which receive the payload of block parameters as it
+// arrives. `offset` is the position of `data` within the payload, so is 0 for
+// the first chars of each block
+typedef void blockFunction(const char* data, size_t length, size_t offset);
+#endif
+
+#ifdef COMMAND_STREAMING
+// Template for functions which receive the parameters of a streaming command
+// one at a time. `idx` is the number of the parameter, starting from 1. Once
+// the command has ended, the function is called again with `param` NULL and
+// `idx` the number of parameters
+typedef void streamFunction(const char* param, unsigned int idx);
+#endif
+
+//////////////////////  COMMAND TABLES  //////////////////////
+
+// These classes store the list of commands in a CommandLookup. Each holds up
+// to `array_size` commands, given by the hash of their keyword, the number of
+// params they take and the function to call, and CommandLookup keeps them
+// sorted by hash.
+//
+// CommandLookup passes lists of up to SCAN_SIZE commands straight to `scan()`.
+// Longer lists are halved until one command is left, which is passed to
+// `scan()` instead.
+//
+// CommandTableStructs stores each command in a struct. This is the default.
+template <size_t array_size>
+class CommandTableStructs
+{
+	// Structure of the data to be stored for each command
+	struct dataStruct {
+		unsigned long hash; // Hash of the keyword (case insensitive)
+		int n; // Number of params this function takes
+		commandFunction* f; // Pointer to this function
+	};
+
+public:
+
+	unsigned long hash(unsigned int i) const { return _commands[i].hash; }
+	int params(unsigned int i) const { return _commands[i].n; }
+	commandFunction* function(unsigned int i) const { return _commands[i].f; }
+
+	// Can a command taking `n` params (or -1 for any number) be stored?
+	static bool holdsParams(int) { return true; }
+
+	// Lists of any length are binary searched
+	static const unsigned int SCAN_SIZE = 1;
+
+	// Position of `hash` among the commands from `lo` to before `hi`, or -1
+	int scan(unsigned long hash, unsigned int lo, unsigned int hi) const {
+
+		for (unsigned int i = lo; i < hi; i++) {
+			if (_commands[i].hash == hash) return i;
+		}
+
+		return -1;
+	}
+
+	void set(unsigned int i, unsigned long hash, int n, commandFunction* f) {
+		_commands[i].hash = hash;
+		_commands[i].n = n;
+		_commands[i].f = f;
+	}
+
+	void move(unsigned int to, unsigned int from) { _commands[to] = _commands[from]; }
+
+private:
+
+	dataStruct _commands[array_size];
+};
+
+// CommandTableArrays stores the hashes, numbers of params and functions in
+// three separate arrays. Searching for a hash then only reads the array of
+// hashes, which is packed densely: 4 bytes per command, rather than a 24 byte
+// struct on a 64 bit host. It also avoids padding: each command takes 7 bytes
+// on AVR. Commands can take at most 127 params
+//
+// Lists of up to COMMAND_HASH_SCAN_SIZE commands are compared all at once,
+// with SIMD instructions if the processor has them (see hashScan.h), rather
+// than binary searched
+//
+// On an x86-64 host, with SSE2 or AVX2, this finds commands faster than
+// CommandTableStructs in lists of up to COMMAND_HASH_SCAN_SIZE commands and of
+// a thousand or more, e.g. 26 ns rather than 35 ns with 4096, and about as
+// fast in between (see the LookupBenchmark example). On AVR, which has no
+// cache or SIMD instructions, it only saves RAM
+template <size_t array_size>
+class CommandTableArrays
+{
+public:
+
+	unsigned long hash(unsigned int i) const { return _hashes[i]; }
+	int params(unsigned int i) const { return _params[i]; }
+	commandFunction* function(unsigned int i) const { return _functions[i]; }
+
+	static bool holdsParams(int n) { return n >= -1 && n <= INT8_MAX; }
+
+	static const unsigned int SCAN_SIZE = COMMAND_HASH_SCAN_SIZE;
+
+	int scan(unsigned long hash, unsigned int lo, unsigned int hi) const {
+
+		const int idx = hash_scan(_hashes + lo, hi - lo, hash);
+
+		return idx < 0 ? -1 : lo + idx;
+	}
+
+	void set(unsigned int i, unsigned long hash, int n, commandFunction* f) {
+		_hashes[i] = hash;
+		_params[i] = n;
+		_functions[i] = f;
+	}
+
+	void move(unsigned int to, unsigned int from) {
+		_hashes[to] = _hashes[from];
+		_params[to] = _params[from];
+		_functions[to] = _functions[from];
+	}
+
+private:
+
+	uint32_t _hashes[array_size];
+	int8_t _params[array_size];
+	commandFunction* _functions[array_size];
+};
+
+//////////////////////  COMMAND LOOKUP  //////////////////////
+
+// This class is responsible for matching strings -> commands
+// It maintains a vector of hashes, associated commands and number of
+// parameters required for those commands
+// `callStoredCommand` performs the lookup and calls the appropriate
+// command, passing through a parameter lookup object
+//
+// The vector is kept sorted by hash, so lookups are a binary search.
+// Registering the same keyword twice returns COMMAND_ALREADY_REGISTERED
+//
+// Its maximum size is determined at compile time by the `array_size` template
+// argument. It is used by CommandHandler, but can be replaced by another class
+// with the same methods (see BasicCommandHandler)
+//
+// The commands are stored in a `Table`, either CommandTableStructs or, to
+// search large lists faster, CommandTableArrays, e.g.
+//
+// "BasicCommandHandler<CommandLookup<100, CommandTableArrays>> handler;
+
+template <size_t array_size, template <size_t> class Table = CommandTableStructs>
+class CommandLookup
+{
+public:
+
+	CommandLookup() :
+		_commandsIdx(0)
+	{}
+
+	// Add a new command to the list, calculating its hash at runtime (deprecated)
+	CommandHandlerReturn registerCommand(const char* command, int num_of_parameters,
+		commandFunction* pointer_to_function) {
+		
+		// Get hash of command
+		const long keyHash = crc32b(command);
+
+		return registerCommand(keyHash, num_of_parameters, pointer_to_function);
+	}
+
+	// Add a new command to the list
+	// The list is kept sorted by hash so that it can be searched quickly
+	CommandHandlerReturn registerCommand(long keyHash, int num_of_parameters,
+		commandFunction* pointer_to_function)
+	{
+		const unsigned long hash = keyHash;
+
+		// Find where this hash belongs in the list
+		const unsigned int pos = lowerBound(hash);
+
+		if (pos < _commandsIdx && _commands.hash(pos) == hash) {
+			CONSOLE_LOG_LN(F("CommandLookup::Command already registered"));
+			return CommandHandlerReturn::COMMAND_ALREADY_REGISTERED;
+		}
+
+		if (_commandsIdx >= array_size) {
+			CONSOLE_LOG_LN(F("CommandLookup::Out of pre-allocated space"));
+			return CommandHandlerReturn::OUT_OF_MEM;
+		}
+
+		if (!Table<array_size>::holdsParams(num_of_parameters)) {
+			CONSOLE_LOG_LN(F("CommandLookup::Too many params"));
+			return CommandHandlerReturn::WRONG_NUM_OF_PARAMS;
+		}
+
+		// Make space for it by moving later commands along one
+		for (unsigned int i = _commandsIdx; i > pos; i--) {
+			_commands.move(i, i - 1);
+		}
+
+		// Store it in the vector
+		_commands.set(pos, hash, num_of_parameters, pointer_to_function);
+		_commandsIdx++;
+
+		return CommandHandlerReturn::NO_ERROR;
+	}
+
+	// Search the list of commands for the given hash
+	// Returns the index of the command, or -1 if not found
+	int findCommand(unsigned long reqHash) const
+	{
+		unsigned int lo = 0;
+		unsigned int length = _commandsIdx;
+
+		// Halve the range which could hold the hash until one command is left.
+		// The half is chosen without a branch, so that the processor has no
+		// branches to mispredict, and the range always shrinks to the same
+		// length whichever half holds the hash
+		if (length > Table<array_size>::SCAN_SIZE) {
+			while (length > 1) {
+				const unsigned int half = length / 2;
+
+				lo = reqHash < _commands.hash(lo + half) ? lo : lo + half;
+				length -= half;
 			}
+		}
+
+		return _commands.scan(reqHash, lo, lo + length);
+	}
+
+	// Execute the command with the given hash with the given parameter
+	// array. `foundIdx` is the index of the command if it has already been
+	// looked up, or -1 if not
+	CommandHandlerReturn callStoredCommand(const ParameterLookup& params,
+		unsigned long reqHash, int foundIdx)
+	{
+
+		CONSOLE_LOG(F("callStoredCommand with n="));
+		CONSOLE_LOG_LN(params.size());
+
+		// A string containing only whitespace has no command
+		if (params.size() == 0) {
+			CONSOLE_LOG_LN(F("Empty command"));
+			return CommandHandlerReturn::EMPTY_COMMAND_STRING;
+		}
+
+		// Look the command up again if the list has changed since
+		if (foundIdx < 0 || foundIdx >= (int)_commandsIdx ||
+			_commands.hash(foundIdx) != reqHash) {
+			foundIdx = findCommand(reqHash);
+		}
+
+		if (foundIdx == -1) {
+			CONSOLE_LOG_LN(F("Command not found"));
+			return CommandHandlerReturn::COMMAND_NOT_FOUND;
+		}
+
+		const int n = _commands.params(foundIdx);
+		const commandFunction* f = _commands.function(foundIdx);
+
+		CONSOLE_LOG(F("Recalled data: n = "));
+		CONSOLE_LOG_LN(n);
+
+		// Return error if wrong number of parameters
+		if (n != (int)params.size() - 1 && n != -1) {
+			CONSOLE_LOG(F("ERROR: Expecting "));
+			CONSOLE_LOG(n);
+			CONSOLE_LOG(F(" parameters but got "));
+			CONSOLE_LOG_LN(params.size() - 1);
 
-			loop++;
+			return CommandHandlerReturn::WRONG_NUM_OF_PARAMS;
 		}
 
-		// We looped to the last char which is a NULL.
-		// Leave it as a NULL and store a pointer to it
-		_endOfString =  loop;
+		CONSOLE_LOG_LN(F("Calling function..."));
+		f(params);
+
+		return params.error();
+	}
+
+protected:
+
+	// Binary search for the position of the first command whose hash is
+	// not less than `hash`
+	unsigned int lowerBound(unsigned long hash) const
+	{
+		unsigned int lo = 0;
+		unsigned int hi = _commandsIdx;
+
+		while (lo < hi) {
+			const unsigned int mid = lo + (hi - lo) / 2;
+
+			if (_commands.hash(mid) < hash)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return lo;
+	}
+
+	// Registered commands, sorted by hash
+	Table<array_size> _commands;
+	unsigned int _commandsIdx;
+
+public:
+
+	// ----------------------------- crc32b --------------------------------
+	// (case insensitive)
+	// Runtime version of COMMANDHANDLER_HASH. The implementation used is
+	// selected in runtimeCrc32.h
+	static uint32_t crc32b(const char *str) {
+	   uint32_t crc = CRC_INITIAL;
 
-		_stringHasNULLS = true;
+	   while (*str) {
+	      crc = crc32bUpdate(crc, *str++);
+	   }
 
-		CONSOLE_LOG(F("ParameterLookup::_theCommand ends at pos "));
-		CONSOLE_LOG_LN(_endOfString);
+	   return crc32bFinal(crc);
 	}
 
-	// Undo the work done by subSpacesForNULL()
-	void restoreSpaces() {
+	// Starting value of the CRC register
+	static const uint32_t CRC_INITIAL = CRC32_INITIAL;
+
+	// Add one char to a running crc32b, so that a hash can be calculated as
+	// chars arrive. Start with CRC_INITIAL and pass the result of the last
+	// char to crc32bFinal() to get the hash
+	static uint32_t crc32bUpdate(uint32_t crc, const char c) {
+	   return crc32_update(crc, c);
+	}
+
+	// Finish a running crc32b
+	static uint32_t crc32bFinal(uint32_t crc) {
+	   return crc32_final(crc);
+	}
+   
+};
+
+// An empty list of commands, for handlers whose commands are all found by
+// other means. Registering a command always fails with OUT_OF_MEM
+template <template <size_t> class Table>
+class CommandLookup<0, Table>
+{
+public:
+
+	CommandHandlerReturn registerCommand(const char*, int, commandFunction*) {
+		return CommandHandlerReturn::OUT_OF_MEM;
+	}
+
+	CommandHandlerReturn registerCommand(long, int, commandFunction*) {
+		return CommandHandlerReturn::OUT_OF_MEM;
+	}
+
+	int findCommand(unsigned long) const { return -1; }
+
+	CommandHandlerReturn callStoredCommand(const ParameterLookup& params,
+		unsigned long, int) {
+
+		if (params.size() == 0) return CommandHandlerReturn::EMPTY_COMMAND_STRING;
+
+		return CommandHandlerReturn::COMMAND_NOT_FOUND;
+	}
+};
+
+// A lookup which passes everything on to another, given by its address, so
+// that several handlers (e.g. one per serial port) can share one list of
+// commands. The list is stored once and commands registered through any of
+// the handlers are seen by all of them, e.g.
+//
+// "CommandLookup<10> commands;
+// "SharedCommandHandler<CommandLookup<10>, &commands> serialHandler;
+// "SharedCommandHandler<CommandLookup<10>, &commands> usbHandler;
+//
+// The address is a template argument, so the lookup must be a global or
+// static object, and this class stores nothing itself
+template <class Lookup, Lookup* lookup>
+class SharedCommandLookup
+{
+public:
+
+	CommandHandlerReturn registerCommand(const char* command, int num_of_parameters,
+		commandFunction* pointer_to_function) {
+		return lookup->registerCommand(command, num_of_parameters, pointer_to_function);
+	}
+
+	CommandHandlerReturn registerCommand(long keyHash, int num_of_parameters,
+		commandFunction* pointer_to_function) {
+		return lookup->registerCommand(keyHash, num_of_parameters, pointer_to_function);
+	}
+
+	int findCommand(unsigned long reqHash) const { return lookup->findCommand(reqHash); }
+
+	// A command found by one handler may have moved by the time it is called,
+	// if another handler registered a command in between. CommandLookup
+	// checks for this and looks it up again
+	CommandHandlerReturn callStoredCommand(const ParameterLookup& params,
+		unsigned long reqHash, int foundIdx) {
+		return lookup->callStoredCommand(params, reqHash, foundIdx);
+	}
+};
+
+#ifdef COMMAND_ISR_RECEIVE
+
+//////////////////////  RECEIVE RING  //////////////////////
+
+// This class passes received chars from an interrupt to the main loop
+// without disabling interrupts. It is a ring buffer with one writer (the
+// interrupt) and one reader (the main loop), each of which only changes its
+// own position in the ring.
+//
+// Chars are only made visible to the reader once the command they belong to
+// is complete: the writer publishes its position with a release store, which
+// the reader loads with an acquire, so that the chars themselves are seen
+// first. If a command doesn't fit in the ring, it is dropped and the reader
+// never sees any of it.
+//
+// Positions are single bytes, which are read and written atomically even on 8
+// bit processors
+template <size_t size>
+class ReceiveRing {
+
+	static_assert(size >= 2 && size <= 256, "ReceiveRing must hold 2 to 256 chars");
+
+public:
 
-		char * loop = _theCommand;
+	ReceiveRing() :
+		_head(0), _published(0), _tail(0), _dropping(false), _dropped(0)
+	{}
 
-		while (loop < _endOfString) {
+	// Writer: add a char. `end` means that it ends a command, so the command
+	// is published
+	void push(const char c, bool end) {
 
-			if ('\0' == *loop) {
+		if (!_dropping) {
 
-				CONSOLE_LOG(F("ParameterLookup::Replacing char at pos "));
-				CONSOLE_LOG(loop - _theCommand);
-				CONSOLE_LOG_LN(F(" with \\s"));
+			const uint8_t next = (_tail + 1) % size;
 
-				// Replace NULL with space
-				*loop = ' ';
+			if (next == __atomic_load_n(&_head, __ATOMIC_ACQUIRE)) {
+				// The ring is full, so forget the rest of this command
+				_dropping = true;
+				_tail = _published;
+			}
+			else {
+				_buffer[_tail] = c;
+				_tail = next;
 			}
+		}
 
-			loop++;
+		if (end) {
+			if (_dropping) {
+				_dropping = false;
+				__atomic_store_n(&_dropped, (uint8_t)(_dropped + 1), __ATOMIC_RELAXED);
+			}
+			else {
+				__atomic_store_n(&_published, _tail, __ATOMIC_RELEASE);
+			}
 		}
+	}
+
+	// Reader: find the published chars which can be read in one run, without
+	// wrapping around the end of the ring. Returns the number of them
+	size_t peek(const char*& data) const {
+
+		const uint8_t published = __atomic_load_n(&_published, __ATOMIC_ACQUIRE);
 
-		// Mark this as done
-		_stringHasNULLS = false;
+		data = _buffer + _head;
+
+		return published >= _head ? published - _head : size - _head;
 	}
 
-	// Pointer to the whole command
-	char * _theCommand;
-	
-	// Internal params	
-	char * _endOfString;
-	bool _stringHasNULLS;
-	unsigned int _size;
+	// Reader: free `length` chars returned by `peek()`
+	void consume(size_t length) {
+		__atomic_store_n(&_head, (uint8_t)((_head + length) % size), __ATOMIC_RELEASE);
+	}
+
+	// Number of commands dropped because they didn't fit, modulo 256
+	uint8_t dropped() const { return __atomic_load_n(&_dropped, __ATOMIC_RELAXED); }
+
+private:
+
+	char _buffer[size];
+
+	// Position of the next char to read, written by the reader
+	volatile uint8_t _head;
+
+	// End of the published chars, written by the writer
+	volatile uint8_t _published;
 
+	// Position of the next char to write and whether the command being
+	// written is being dropped, only used by the writer
+	uint8_t _tail;
+	bool _dropping;
+
+	// Number of commands dropped, written by the writer
+	volatile uint8_t _dropped;
 };
 
-// Template for the functions to be called in response to a command
-typedef void commandFunction(const ParameterLookup& params);
+#endif
 
 //////////////////////  COMMAND HANDLER  //////////////////////
 
@@ -318,13 +1075,50 @@ typedef void commandFunction(const ParameterLookup& params);
 // fed chars from the serial input by `addCommandChar()`
 // When a command is ready it will flag `commandWaiting()`
 // When convenient, `executeCommand()` should then be called. This will
-// invoke the nested CommandLookup object in order to get the right command
-// and execute it
+// invoke the `Lookup` object in order to get the right command and execute it
 //
-// This object can hold <size> commands where <size> is defined at compile time, e.g.
+// Normally the lookup is a CommandLookup, and `CommandHandler` holds <size>
+// commands where <size> is defined at compile time, e.g.
 // 
 // "CommandHandler<10> handler;
 //
+// Other lookups, such as FlashCommandLookup in flashCommandTable.h or
+// SharedCommandLookup, which shares one list of commands between several
+// handlers, can be used by naming them in BasicCommandHandler instead, e.g.
+//
+// "BasicCommandHandler<CommandLookup<10>, 4> handler;
+//
+// Received commands are queued until they are executed. By default only one
+// command can wait at a time: further chars are refused with BUFFER_FULL
+// until `executeCommand()` is called. To allow <queue_size> commands to wait,
+// pass a second template argument, e.g.
+//
+// "CommandHandler<10, 4> handler;
+//
+// Waiting commands are stored end to end in a single buffer of
+// queue_size * (buffer_size + 1) chars and are executed in the order they
+// were received. Commands must be shorter than <buffer_size> chars, which is
+// COMMAND_SIZE_MAX unless given as a third template argument, so that each
+// handler can reserve only the RAM it needs, e.g.
+//
+// "CommandHandler<10, 1, 32> debugConsole;
+// "CommandHandler<10, 2, 512> dataPort;
+//
+// Positions within the buffer are stored in the smallest type which can hold
+// them: a uint8_t if the buffer is no larger than 255 chars.
+//
+// The hash of each command's keyword is calculated as its chars are received,
+// and the keyword is looked up as soon as it ends. If it is not registered,
+// the rest of the command is discarded without being stored and
+// `executeCommand()` returns COMMAND_NOT_FOUND for it. A command must
+// therefore be registered before its keyword is received: registering it
+// while the line is waiting in the queue is too late.
+//
+// If COMMAND_INCREMENTAL_PARSING is set, each command is split into
+// parameters as its chars are received, so that `executeCommand()` does not
+// need to scan it again. This costs sizeof(BasicParameterTable<buffer_size>)
+// bytes per queued command.
+//
 // This class also contains methods for storing commands in the EEPROM in 
 // order to queue a command on device startup
 // These can be disabled by adding the line:
@@ -332,31 +1126,63 @@ typedef void commandFunction(const ParameterLookup& params);
 // The user must call `executeStartupCommands()` in their code once they are ready 
 // for EEPROM commands to be executed
 
-template <size_t array_size>
-class CommandHandler
+template <class Lookup, size_t queue_size = 1, size_t buffer_size = COMMAND_SIZE_MAX>
+class BasicCommandHandler
 {
 
-	// Forward declare the CommandLookup class
-private:
-	class CommandLookup;
+	static_assert(buffer_size >= 2, "Commands need a buffer of at least 2 chars");
 
 public:
 
 	// Constuctor
 	// Initialise private members
-	CommandHandler() :
+	BasicCommandHandler() :
 		_lookupList(), // Not needed, but just to be explicit
+		_queueHead(0),
+		_queueCount(0),
+		_lineStart(0),
+		_bufferLength(0),
 		_command_too_long(false),
-		_bufferFull(false),
-		_bufferLength(0)
+		_command_not_found(false),
+		_keywordState(KEYWORD_NOT_STARTED),
+		_keywordCrc(CRC32_INITIAL)
 	{
 		CONSOLE_LOG_LN(F("CommandHandler::CommandHandler()"));
 
 		// Start the input buffer empty
 		_inputBuffer[0] = '\0';
+
+#ifdef COMMAND_INCREMENTAL_PARSING
+		receivingCommand().params.clear();
+#endif
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+		_blockSink = NULL;
+		_blockBuffer = NULL;
+		_blockBufferSize = 0;
+		_blockState = BLOCK_NONE;
+		_blockReceived = -1;
+		_blocksWaiting = 0;
+		_block_buffer_busy = false;
+#endif
+
+#ifdef COMMAND_TRANSMIT_RING
+		_response.setOutput(&_transmit);
+#endif
+
+#ifdef COMMAND_STREAMING
+		_streamsIdx = 0;
+		_stream = NULL;
+		_streamParamLength = 0;
+		_streamParamCount = 0;
+#endif
+
+#ifdef COMMAND_SCPI_TREE
+		_afterSeparator = false;
+#endif
 	}
 
-	// Execute the waiting command
+	// Execute the oldest waiting command
 	CommandHandlerReturn executeCommand()
 	{
 
@@ -364,23 +1190,33 @@ public:
 
 		CONSOLE_LOG_LN(F("Execute command"));
 
+#ifdef COMMAND_TRANSMIT_RING
+		// Make as much room for the reply as possible
+		service();
+#endif
+
 		// Return error code if no command waiting
 		if (!commandWaiting()) {
 			CONSOLE_LOG_LN(F("No command error"));
-			error = CommandHandlerReturn::NO_COMMAND_WAITING;
+			return CommandHandlerReturn::NO_COMMAND_WAITING;
 		}
 
-		// Return error code if command over-ran
-		if (_command_too_long) {
-			CONSOLE_LOG_LN(F("Overflow error"));
-			error = CommandHandlerReturn::COMMAND_TOO_LONG;
+		const queuedCommand& cmd = _queue[_queueHead];
+		char * const commandStr = _inputBuffer + cmd.start;
+
+		// Return error code if command over-ran or wasn't found as it was
+		// received
+		if (cmd.error != CommandHandlerReturn::NO_ERROR) {
+			CONSOLE_LOG(F("Error during reception: "));
+			CONSOLE_LOG_LN((int)cmd.error);
+			error = cmd.error;
 		}
 
 		CONSOLE_LOG(F("Command is: "));
-		CONSOLE_LOG_LN(_inputBuffer);
+		CONSOLE_LOG_LN(commandStr);
 
 		// Return error code if string is empty
-		if (_bufferLength == 0 && error == CommandHandlerReturn::NO_ERROR)
+		if (cmd.length == 0 && error == CommandHandlerReturn::NO_ERROR)
 		{
 			CONSOLE_LOG_LN(F("Empty command error"));
 			error = CommandHandlerReturn::EMPTY_COMMAND_STRING;
@@ -390,17 +1226,48 @@ public:
 		if (error == CommandHandlerReturn::NO_ERROR) {
 
 			// Constuct a parameter lookup object from the command string
-			// This invalidates the string for future use
 			CONSOLE_LOG_LN(F("Creating ParameterLookup object..."));
-			ParameterLookup lookupObj = ParameterLookup(_inputBuffer);
+#ifdef COMMAND_INCREMENTAL_PARSING
+			BasicParameterLookup<buffer_size> lookupObj(commandStr, cmd.params);
+#else
+			BasicParameterLookup<buffer_size> lookupObj(commandStr);
+#endif
 
-			CONSOLE_LOG_LN(F("Running callStoredCommand..."));
-			error = _lookupList.callStoredCommand(lookupObj);
+#ifdef COMMAND_BLOCK_PARAMETERS
+			lookupObj.setBlock(_blockSink ? NULL : _blockBuffer, cmd.block);
+#endif
+
+#ifdef COMMAND_RESPONSES
+			lookupObj.setResponse(&_response);
+			_response.nextCommand();
+#endif
+
+			CONSOLE_LOG_LN(F("Running callCommand..."));
+			error = callCommand(lookupObj, cmd);
 
 		}
 
-		// Mark buffer as ready again
-		clearBuffer();
+#ifdef COMMAND_RESPONSES
+		// Replies are written out once the line of commands has ended
+		if (cmd.endsLine) _response.endLine();
+#endif
+
+#ifdef COMMAND_TRANSMIT_RING
+		// Report a reply which was too long to fit in the ring
+		if (_transmit.overflowed()) {
+			CONSOLE_LOG_LN(F("ERROR: reply overflowed the transmit ring!"));
+
+			if (error == CommandHandlerReturn::NO_ERROR)
+				error = CommandHandlerReturn::OUT_OF_MEM;
+
+			_transmit.clearOverflow();
+		}
+
+		service();
+#endif
+
+		// Free the space used by this command
+		popCommand();
 
 		return error;
 	}
@@ -426,26 +1293,129 @@ public:
 			pointer_to_function);
 	}
 
+#ifdef COMMAND_RESPONSES
+	// Set where the replies of commands are written, e.g.
+	// 		setResponseOutput(Serial);
+	void setResponseOutput(Print& output) {
+#ifdef COMMAND_TRANSMIT_RING
+		_transmit.setOutput(&output);
+#else
+		_response.setOutput(&output);
+#endif
+	}
+
+	// The buffer for the replies of commands, which they can also reach with
+	// `params.response()`
+	CommandResponse& response() { return _response; }
+#endif
+
+#ifdef COMMAND_STREAMING
+	// Register a streaming command, e.g.
+	// 		registerStreamingCommand(COMMANDHANDLER_HASH("data"), &receiveData);
+	// Its parameters are not stored: once the keyword has been matched, each
+	// one is passed to `f` as soon as it is complete, so the command can have
+	// any number of them. Each parameter must be shorter than
+	// COMMAND_STREAM_PARAM_MAX, or the rest of the command is discarded and
+	// `f` is not told that it ended.
+	//
+	// The command is then queued as usual, but `executeCommand()` only
+	// reports any error. Since `f` is called as the chars are received, it is
+	// called before any commands still waiting in the queue are executed
+	CommandHandlerReturn registerStreamingCommand(uint32_t hash, streamFunction* f) {
+
+		if (findStream(hash) || _lookupList.findCommand(hash) >= 0) {
+			CONSOLE_LOG_LN(F("CommandHandler::Command already registered"));
+			return CommandHandlerReturn::COMMAND_ALREADY_REGISTERED;
+		}
+
+		if (_streamsIdx >= COMMAND_STREAMING_MAX) {
+			CONSOLE_LOG_LN(F("CommandHandler::Out of streaming command space"));
+			return CommandHandlerReturn::OUT_OF_MEM;
+		}
+
+		_streams[_streamsIdx].hash = hash;
+		_streams[_streamsIdx].f = f;
+		_streamsIdx++;
+
+		return CommandHandlerReturn::NO_ERROR;
+	}
+#endif
+
+#ifdef COMMAND_SCPI_TREE
+	// Set the root of a tree of commands stored in flash (see scpiTree.h), e.g.
+	// 		h.setCommandTree(rootNodes);
+	// Headers are looked up in the tree first, then among the commands added
+	// by `registerCommand()`
+	template <size_t root_size>
+	void setCommandTree(const ScpiNode (&root)[root_size]) {
+		static_assert(root_size <= 255, "A command tree's root can have at most 255 nodes");
+		_path.setRoot(root, root_size);
+	}
+#endif
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+	// Store the payloads of block parameters in `buffer`, which holds `size`
+	// chars, instead of in the input buffer, e.g. for "DATA #15hello" the
+	// command's params are "DATA" and "#15" and `params.block()` points to
+	// "hello" in `buffer`.
+	//
+	// A block which doesn't fit gives COMMAND_TOO_LONG. The buffer holds one
+	// payload, so a block which arrives while a command with an earlier one
+	// is waiting to be executed gives BUFFER_FULL. If a command has several
+	// blocks, only the last is kept
+	void setBlockBuffer(char* buffer, size_t size) {
+		_blockSink = NULL;
+		_blockBuffer = buffer;
+		_blockBufferSize = size;
+	}
+
+	// Pass the payloads of block parameters to `sink` as they arrive, instead
+	// of storing them. The command is then executed with `params.block()`
+	// NULL, but `params.blockLength()` still gives the length
+	void setBlockSink(blockFunction* sink) {
+		_blockSink = sink;
+		_blockBuffer = NULL;
+		_blockBufferSize = 0;
+	}
+#endif
+
 	// Add a char from the serial connection to be processed and added to the queue
-	// Returns BUFFER_FULL if buffer is full and char wasn't added
+	// Returns BUFFER_FULL if buffer is full and char wasn't added, or
+	// COMMAND_TOO_LONG if the command has overrun the buffer. Other errors in
+	// the command, such as an unregistered keyword, are returned by
+	// `executeCommand()`
 	CommandHandlerReturn addCommandChar(const char c)
 	{
 
-		// Check if the buffer is already full
-		if (_bufferFull) {
+		// Check if the queue is already full
+		if (bufferFull()) {
 			return CommandHandlerReturn::BUFFER_FULL;
 		}
 
-		// If c is a newline, mark the buffer as full
-		if (c == '\n') {
+#ifdef COMMAND_BLOCK_PARAMETERS
+		// The payload of a block may contain any char, even newlines
+		if (_blockState == BLOCK_PAYLOAD) {
+			addBlockChars(&c, 1);
+			return CommandHandlerReturn::NO_ERROR;
+		}
+#endif
+
+		// If c is a newline (or a ';' between SCPI commands), queue the command
+		if (isCommandEnd(c)) {
 
 			CONSOLE_LOG(F("Newline received. Command: "));
-			CONSOLE_LOG_LN(_inputBuffer);
+			CONSOLE_LOG_LN(_inputBuffer + _lineStart);
 
 			// We are already null terminated so mark the string as ready
-			_bufferFull = true;
+			pushCommand(c);
+
+#ifdef COMMAND_SCPI_TREE
+			// Headers are only relative to earlier ones on the same line
+			if (c == '\n') _path.reset();
+#endif
 
-			// _command_too_long will be detected by executeCommand if it is set
+			// _command_too_long and _command_not_found will be detected by
+			// executeCommand if they are set
 		}
 		// if c is a carridge return, ignore it
 		else if (c == '\r') {
@@ -454,7 +1424,33 @@ public:
 		}
 		// else c is a normal char, so add it to the buffer
 		else {
-			if (_command_too_long || _bufferLength >= COMMAND_SIZE_MAX-1)
+#ifdef COMMAND_BLOCK_PARAMETERS
+			addBlockHeaderChar(c);
+#endif
+
+			// Update the hash of the keyword until it's complete. If it isn't
+			// registered, there's no need to store the rest of the command
+			if (_keywordState != KEYWORD_DONE) {
+				addKeywordChar(c);
+			}
+
+			// The rest of the command is discarded. The error is reported
+			// when it is executed
+			if (_command_not_found) {
+				return CommandHandlerReturn::NO_ERROR;
+			}
+
+#ifdef COMMAND_STREAMING
+			// The params of a streaming command are passed on, not stored
+			if (_stream && !_command_too_long) {
+				addStreamChar(c);
+
+				return _command_too_long ? CommandHandlerReturn::COMMAND_TOO_LONG :
+					CommandHandlerReturn::NO_ERROR;
+			}
+#endif
+
+			if (_command_too_long || _bufferLength >= buffer_size-1 || !reserveSpace(1))
 			{
 				// Command was too long! Set the `_command_too_long` flag to chuck away all subsequent chars until next newline
 				CONSOLE_LOG_LN(F("ERROR: command too long!"));
@@ -467,30 +1463,228 @@ public:
 			{
 				// The normal case. Add the new char to the buffer
 
-				_inputBuffer[_bufferLength] = c;
+				char * const line = _inputBuffer + _lineStart;
+
+				line[_bufferLength] = c;
 
 				_bufferLength++;
 
 				// Ensure that the buffer always contains valid c str
-				_inputBuffer[_bufferLength] = '\0';
+				line[_bufferLength] = '\0';
+
+#ifdef COMMAND_INCREMENTAL_PARSING
+				receivingCommand().params.addChar(c);
+#endif
+
+				CONSOLE_LOG(F("Char received: '"));
+				CONSOLE_LOG(c);
+				CONSOLE_LOG(F("', Buffer length: "));
+				CONSOLE_LOG_LN(_bufferLength);
+
+				return CommandHandlerReturn::NO_ERROR;
+			}
+		}
+
+		return CommandHandlerReturn::UNKNOWN_ERROR; // We should never get here
+	}
+
+	// Add a block of chars from the serial connection. This is equivalent to
+	// calling `addCommandChar()` for each char in turn, but searches the block
+	// for the end of each command and copies the whole run into the buffer at
+	// once.
+	//
+	// Processing stops if the queue of waiting commands becomes full, since
+	// no more can be accepted until `executeCommand()` is called. Chars of a
+	// command which is too long are skipped up to the next newline.
+	//
+	// Returns the number of chars consumed from `data`. Any chars that were not
+	// consumed should be passed again once a waiting command is executed.
+	size_t addCommandChars(const char* data, size_t len)
+	{
+		size_t consumed = 0;
+
+		while (consumed < len && !bufferFull()) {
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+			// Pass on the payload of a block all at once, but follow its
+			// header one char at a time
+			if (_blockState == BLOCK_PAYLOAD) {
+				consumed += addBlockChars(data + consumed, len - consumed);
+				continue;
+			}
+
+			if (_blockState == BLOCK_HASH || _blockState == BLOCK_LENGTH) {
+				addCommandChar(data[consumed++]);
+				continue;
+			}
+#endif
+
+			const char* runStart = data + consumed;
+			const size_t remaining = len - consumed;
+
+			// Find the end of this command, if it's in this block
+			const char* commandEnd = findCommandEnd(runStart, remaining);
+			size_t runLength = commandEnd ? commandEnd - runStart : remaining;
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+			// A '#' may start a block, whose payload could contain the
+			// newline that was found, so stop the run before it
+			const char* blockStart = blocksEnabled() ?
+				(const char*)memchr(runStart, '#', runLength) : NULL;
+
+			if (blockStart) {
+				runLength = blockStart - runStart;
+				commandEnd = NULL;
+			}
+#endif
+
+			// If we're already discarding this command, don't look at the chars
+			if (!_command_too_long && !_command_not_found) {
+				appendToBuffer(runStart, runLength);
+			}
+
+			consumed += runLength;
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+			// Only the last char of the run matters to the block header
+			if (runLength > 0) addBlockHeaderChar(runStart[runLength - 1]);
+
+			if (blockStart) {
+				addCommandChar(*blockStart);
+				consumed++;
+			}
+#endif
+
+			if (commandEnd) {
+				CONSOLE_LOG(F("Newline received. Command: "));
+				CONSOLE_LOG_LN(_inputBuffer + _lineStart);
+
+				// We are already null terminated so mark the string as ready
+				pushCommand(*commandEnd);
+				consumed++;
+
+#ifdef COMMAND_SCPI_TREE
+				// Headers are only relative to earlier ones on the same line
+				if (*commandEnd == '\n') _path.reset();
+#endif
+			}
+		}
+
+		return consumed;
+	}
+
+	// Read all available chars from a Stream (e.g. `Serial`) and process them
+	// with `addCommandChars()`. Reading pauses at the end of each command so
+	// that no chars are removed from the stream unless they can be processed.
+	//
+	// Returns the number of chars consumed
+	size_t poll(Stream& stream)
+	{
+		size_t consumed = 0;
+
+		while (!bufferFull()) {
+
+			int available = stream.available();
+			if (available <= 0) break;
+
+			char chunk[COMMAND_POLL_CHUNK_SIZE];
+			size_t chunkLength = 0;
+
+			// Read up to and including the end of the next command
+			while (chunkLength < COMMAND_POLL_CHUNK_SIZE && available-- > 0) {
+
+				const char c = stream.read();
+				chunk[chunkLength++] = c;
+
+				if (isCommandEnd(c)) break;
+			}
+
+			consumed += addCommandChars(chunk, chunkLength);
+		}
+
+		return consumed;
+	}
+
+#ifdef COMMAND_ISR_RECEIVE
+	// Add a char from an interrupt, e.g. a UART's receive interrupt. This only
+	// stores the char, so is quick and safe to call while the main loop is in
+	// any other method. The main loop must then call `poll()` to process the
+	// commands received. A command which doesn't fit in the COMMAND_RECEIVE_SIZE
+	// char ring is dropped: see `droppedCommands()`.
+	//
+	// This must only be called from one interrupt, and `addCommandChar()`,
+	// `addCommandChars()` and `poll(Stream&)` must not be used as well
+	void addCommandCharFromISR(const char c) {
+		_receive.push(c, isCommandEnd(c));
+	}
+
+	// Process the commands received by `addCommandCharFromISR()` with
+	// `addCommandChars()`, as far as the queue has room for them. Chars which
+	// can't be processed yet are left for the next call.
+	//
+	// Returns the number of chars consumed
+	size_t poll()
+	{
+		size_t consumed = 0;
+
+		while (!bufferFull()) {
+
+			const char* data;
+			const size_t available = _receive.peek(data);
+
+			if (available == 0) break;
 
-				CONSOLE_LOG(F("Char received: '"));
-				CONSOLE_LOG(c);
-				CONSOLE_LOG(F("', Buffer length: "));
-				CONSOLE_LOG_LN(_bufferLength);
+			const size_t used = addCommandChars(data, available);
 
-				return CommandHandlerReturn::NO_ERROR;
-			}
+			_receive.consume(used);
+			consumed += used;
 		}
 
-		return CommandHandlerReturn::UNKNOWN_ERROR; // We should never get here
+		return consumed;
 	}
 
+	// Number of commands dropped by `addCommandCharFromISR()` because they
+	// didn't fit, modulo 256
+	uint8_t droppedCommands() const { return _receive.dropped(); }
+#endif
+
 	// Check to see if the handler is ready for more incoming chars
-	inline bool bufferFull() { return _bufferFull; }
+	inline bool bufferFull() { return _queueCount >= queue_size; }
 
 	// Is a command waiting?
-	inline bool commandWaiting() { return bufferFull(); }
+	inline bool commandWaiting() {
+#ifdef COMMAND_TRANSMIT_RING
+		// Don't call another command until there's room for its reply
+		if (!transmitReady()) return false;
+#endif
+		return _queueCount > 0;
+	}
+
+#ifdef COMMAND_TRANSMIT_RING
+	// Write waiting replies to the output, as far as it has room for them
+	// without blocking. Call this regularly, e.g. in `loop()`.
+	//
+	// While the ring doesn't have room for a whole COMMAND_RESPONSE_SIZE_MAX
+	// reply, no more commands are executed: `commandWaiting()` returns false
+	// and received commands wait in the queue. A reply too long to fit makes
+	// `executeCommand()` return OUT_OF_MEM, and the rest of it is lost.
+	//
+	// If no output has been set, replies are discarded, so the ring never
+	// holds commands back. See TransmitRing for outputs which can't report
+	// how much room they have
+	void service() { _transmit.service(); }
+
+	// Is there room in the transmit ring for the reply to another command?
+	bool transmitReady() const {
+		return _transmit.space() > COMMAND_RESPONSE_SIZE_MAX;
+	}
+
+	// The ring of replies waiting to be transmitted
+	TransmitRing& transmitter() { return _transmit; }
+#endif
+
+	// Number of commands waiting to be executed
+	inline size_t queuedCommands() { return _queueCount; }
 
 #ifndef EEPROM_DISABLED
 	// Store a command to be executed on startup in the EEPROM
@@ -678,7 +1872,7 @@ public:
 		// Command is waiting, so queue it one char at a time
 		// If we reach a newline, commandWaiting() will flag "true": execute the command
 		// If we reach a NULL, end
-		// If we've read COMMAND_SIZE_MAX - 2 bytes from EEPROM, stop and add a newline + NULL
+		// If we've read EEPROM_SIZE_MAX bytes from EEPROM, stop and add a newline
 		
 		// Index of location in EEPROM
 		int EEPROM_idx = EEPROM_STORED_COMMAND_LOCATION;
@@ -724,6 +1918,11 @@ public:
 				// Queue the char
 				addCommandChar(c);
 
+#ifdef COMMAND_TRANSMIT_RING
+				// Make room for the reply, so that the command isn't held back
+				service();
+#endif
+
 				// If CommandHandler is ready to execute the queued command, do so
 				if (commandWaiting()) {
 					result = executeCommand();
@@ -741,168 +1940,669 @@ public:
 
 private:
 
-	void clearBuffer() {
-		// Mark buffer as ready again
-		_bufferFull = false;
-		_command_too_long = false;
-		_inputBuffer[0] = '\0';
-		_bufferLength = 0;
+	// Type used to store positions within `_inputBuffer`
+	typedef typename BufferIndex<queue_size * (buffer_size + 1)>::type index_t;
+
+	// Structure describing a command waiting in `_inputBuffer`
+	struct queuedCommand {
+		index_t start; // Position of the command in `_inputBuffer`
+		index_t length; // Length of the command, excluding null terminator
+		CommandHandlerReturn error; // Any error found while receiving the command
+		unsigned long hash; // Hash of the keyword
+		int command; // Index of the keyword in `_lookupList`, or -1
+#ifdef COMMAND_SCPI_TREE
+		const ScpiNode* node; // Node of the command in the tree, or NULL
+#endif
+#ifdef COMMAND_INCREMENTAL_PARSING
+		BasicParameterTable<buffer_size> params; // Positions of the command's params
+#endif
+#ifdef COMMAND_BLOCK_PARAMETERS
+		long block; // Length of the command's block payload, or -1
+#endif
+#ifdef COMMAND_STREAMING
+		bool streamed; // The command's params were passed to a streamFunction
+#endif
+#ifdef COMMAND_RESPONSES
+		bool endsLine; // The command was the last on its line
+#endif
+	};
+
+	// Does this char end a command?
+	static bool isCommandEnd(const char c) {
+#ifdef COMMAND_SCPI_TREE
+		return '\n' == c || ';' == c;
+#else
+		return '\n' == c;
+#endif
 	}
 
-	// An object for handling the matching of commands -> functions
-	CommandLookup _lookupList;
+	// Find the first char in `data` which ends a command. Returns NULL if
+	// there isn't one
+	static const char* findCommandEnd(const char* data, size_t len) {
 
-	// Flag to warn that the command handler cannot handle more incoming chars
-	// until the current command is processed
-	bool _bufferFull;
+		const char* end = (const char*)memchr(data, '\n', len);
 
-	// A buffer for receiving new commands
-	char _inputBuffer[COMMAND_SIZE_MAX + 1];
-	unsigned int _bufferLength;
+#ifdef COMMAND_SCPI_TREE
+		const char* separator = (const char*)memchr(data, ';', end ? end - data : len);
+		if (separator) end = separator;
+#endif
 
-	// A flag to report that the command currently being received has overrun
-	bool _command_too_long;
+		return end;
+	}
 
-	//////////////////////  COMMAND LOOKUP  //////////////////////
+	// Call the function for a waiting command
+	CommandHandlerReturn callCommand(const ParameterLookup& params, const queuedCommand& cmd) {
 
-	// This class is responsible for matching strings -> commands
-	// It maintains a vector of hashes, associated commands and number of
-	// parameters required for those commands
-	// `callStoredCommand` performs the lookup and calls the appropriate
-	// command, passing through a parameter lookup object
-	//
-	// Its maximum size is determined at compile time by the `size` template argument
+#ifdef COMMAND_STREAMING
+		// A streaming command was called as it arrived
+		if (cmd.streamed) return CommandHandlerReturn::NO_ERROR;
+#endif
 
-private:
-	// Structure of the data to be stored for each command
-	struct dataStruct {
-		unsigned long hash; // Hash of the keyword (case insensitive)
-		int n; // Number of params this function takes
-		commandFunction* f; // Pointer to this function
-	};
+#ifdef COMMAND_SCPI_TREE
+		ScpiNode node;
 
-	class CommandLookup
-	{
-	public:
+		if (ScpiPath::readNode(cmd.node, node)) {
 
-		CommandLookup() :
-			_commandsIdx(0)
-		{}
+			CONSOLE_LOG(F("Calling tree command with n="));
+			CONSOLE_LOG_LN(params.size());
 
-		// Add a new command to the list, calculating its hash at runtime (deprecated)
-		CommandHandlerReturn registerCommand(const char* command, int num_of_parameters,
-			commandFunction* pointer_to_function) {
-			
-			// Get hash of command
-			const long keyHash = crc32b(command);
+			// Return error if wrong number of parameters
+			if (node.n != (int)params.size() - 1 && node.n != -1) {
+				CONSOLE_LOG_LN(F("ERROR: Wrong number of parameters"));
+				return CommandHandlerReturn::WRONG_NUM_OF_PARAMS;
+			}
+
+			node.f(params);
 
-			return registerCommand(keyHash, num_of_parameters, pointer_to_function);
+			return params.error();
 		}
+#endif
 
-		// Add a new command to the list
-		CommandHandlerReturn registerCommand(long keyHash, int num_of_parameters,
-			commandFunction* pointer_to_function)
-		{
-			if (_commandsIdx >= array_size) {
-				CONSOLE_LOG_LN(F("CommandLookup::Out of pre-allocated space"));
-				return CommandHandlerReturn::OUT_OF_MEM;
+		return _lookupList.callStoredCommand(params, cmd.hash, cmd.command);
+	}
+
+	// Copy a run of chars (not including a newline) into the input buffer,
+	// stripping carridge returns. If the buffer overflows, the
+	// `_command_too_long` flag is set and the rest of the run is discarded.
+	// Likewise if the keyword is not registered, `_command_not_found` is set
+	void appendToBuffer(const char* run, size_t runLength) {
+
+		const char* const runEnd = run + runLength;
+
+		while (run < runEnd) {
+
+			// Copy up to the next carridge return
+			const char* cr = (const char*)memchr(run, '\r', runEnd - run);
+			const size_t segmentLength = (cr ? cr : runEnd) - run;
+
+			// Hash the keyword, if it's in this segment
+#ifdef COMMAND_STREAMING
+			const bool keywordWasDone = _keywordState == KEYWORD_DONE;
+#endif
+			size_t keywordEnd = 0;
+
+			while (keywordEnd < segmentLength && _keywordState != KEYWORD_DONE) {
+				addKeywordChar(run[keywordEnd++]);
 			}
 
-			// Set up a struct containing the number of params and a pointer to the function
-			dataStruct d;
+			if (_command_not_found) return;
 
-			// Save params
-			d.hash = keyHash;
-			d.n = num_of_parameters;
-			d.f = pointer_to_function;
+#ifdef COMMAND_STREAMING
+			if (_stream) {
+				// Store the keyword, without the delimiter which ended it,
+				// then pass the params on
+				if (!keywordWasDone && !storeChars(run, keywordEnd - 1)) return;
 
-			// Store it in the vector
-			_commands[_commandsIdx++] = d;
+				for (size_t i = keywordEnd; i < segmentLength && !_command_too_long; i++) {
+					addStreamChar(run[i]);
+				}
 
-			return CommandHandlerReturn::NO_ERROR;
+				if (_command_too_long) return;
+			}
+			else
+#endif
+			if (!storeChars(run, segmentLength)) return;
+
+			// Skip the carridge return, if there was one
+			run += segmentLength + (cr ? 1 : 0);
 		}
+	}
 
-		// Search the list of commands for the given command and execute it with the given parameter array
-		CommandHandlerReturn callStoredCommand(const ParameterLookup& params)
-		{
+	// Add chars to the command being received, setting the `_command_too_long`
+	// flag if they don't fit. Returns false if they weren't added
+	bool storeChars(const char* chars, size_t length) {
 
-			CONSOLE_LOG(F("callStoredCommand with n="));
-			CONSOLE_LOG_LN(params.size());
+		if (_bufferLength + length > buffer_size - 1 ||
+			!reserveSpace(length)) {
+			CONSOLE_LOG_LN(F("ERROR: command too long!"));
+			_command_too_long = true;
+			return false;
+		}
 
-			// Get hash of command requested
-			const unsigned long reqHash = crc32b(params[0]);
+		memcpy(_inputBuffer + _lineStart + _bufferLength, chars, length);
+		_bufferLength += length;
 
-			int foundIdx = -1;
+		// Ensure that the buffer always contains valid c str
+		_inputBuffer[_lineStart + _bufferLength] = '\0';
 
-			// Search through vector for this hash
-			for (int i = 0; i < _commandsIdx; i++) {
-				if (reqHash == _commands[i].hash) {
-					foundIdx = i;
-					break;
-				}
+#ifdef COMMAND_INCREMENTAL_PARSING
+		BasicParameterTable<buffer_size>& params = receivingCommand().params;
+
+		for (size_t i = 0; i < length; i++) {
+			params.addChar(chars[i]);
+		}
+#endif
+
+		return true;
+	}
+
+	// Ensure that there is room in `_inputBuffer` to extend the command
+	// currently being received by `extra` chars plus a null terminator.
+	// If there isn't room at the end of the buffer, the waiting commands and
+	// the current one are moved to the start of the buffer to make space.
+	// Returns false if there is no room.
+	bool reserveSpace(size_t extra) {
+
+		if (_lineStart + _bufferLength + extra < sizeof(_inputBuffer))
+			return true;
+
+		// Find the start of the oldest data still in use
+		const unsigned int usedStart = _queueCount ?
+			_queue[_queueHead].start : _lineStart;
+
+		if (usedStart > 0) {
+
+			CONSOLE_LOG(F("CommandHandler::Compacting buffer by "));
+			CONSOLE_LOG_LN(usedStart);
+
+			memmove(_inputBuffer, _inputBuffer + usedStart,
+				_lineStart + _bufferLength + 1 - usedStart);
+
+			for (size_t i = 0; i < _queueCount; i++) {
+				_queue[(_queueHead + i) % queue_size].start -= usedStart;
 			}
 
-			if (foundIdx == -1) {
-				CONSOLE_LOG_LN(F("Command not found"));
-				return CommandHandlerReturn::COMMAND_NOT_FOUND;
+			_lineStart -= usedStart;
+		}
+
+		return _lineStart + _bufferLength + extra < sizeof(_inputBuffer);
+	}
+
+	// Update the hash of the keyword of the command being received. Leading
+	// whitespace is skipped and the keyword ends at the next whitespace
+	void addKeywordChar(const char c) {
+
+		if (ParameterTable::isDelimiter(c)) {
+			if (_keywordState == KEYWORD_STARTED) endKeyword();
+		}
+		else {
+#ifdef COMMAND_SCPI_TREE
+			_path.addChar(c);
+
+			// A leading colon only means that the header starts from the root of
+			// the tree, so isn't part of the keyword of a registered command
+			if (c == ':' && _keywordState == KEYWORD_NOT_STARTED) {
+				_keywordState = KEYWORD_STARTED;
+				return;
 			}
+#endif
+
+			_keywordState = KEYWORD_STARTED;
+			_keywordCrc = crc32_update(_keywordCrc, c);
+		}
+	}
 
-			const dataStruct& d = _commands[foundIdx];
-			const commandFunction* f = d.f;
+	// The keyword of the command being received is complete, so look it up
+	void endKeyword() {
 
-			CONSOLE_LOG(F("Recalled data: d.n = "));
-			CONSOLE_LOG_LN(d.n);
+		queuedCommand& cmd = receivingCommand();
 
-			// Return error if wrong number of parameters
-			if (d.n != params.size() - 1 && d.n != -1) {
-				CONSOLE_LOG(F("ERROR: Expecting "));
-				CONSOLE_LOG(d.n);
-				CONSOLE_LOG(F(" parameters but got "));
-				CONSOLE_LOG_LN(params.size() - 1);
+		cmd.hash = crc32_final(_keywordCrc);
+		cmd.command = _lookupList.findCommand(cmd.hash);
 
-				return CommandHandlerReturn::WRONG_NUM_OF_PARAMS;
+		CONSOLE_LOG(F("CommandHandler::Keyword received, index "));
+		CONSOLE_LOG_LN(cmd.command);
+
+#ifdef COMMAND_SCPI_TREE
+		cmd.node = _path.endHeader();
+		bool found = cmd.node || cmd.command >= 0;
+#else
+		bool found = cmd.command >= 0;
+#endif
+
+#ifdef COMMAND_STREAMING
+		_stream = findStream(cmd.hash);
+		if (_stream) found = true;
+#endif
+
+		if (!found) {
+			CONSOLE_LOG_LN(F("ERROR: command not found!"));
+			_command_not_found = true;
+		}
+
+		_keywordState = KEYWORD_DONE;
+	}
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+	// Are block parameters received?
+	bool blocksEnabled() const { return _blockSink || _blockBuffer; }
+
+	// Follow the header of a block parameter, e.g. "#15" in "DATA #15hello",
+	// which is '#', then the number of digits in the payload's length, then
+	// the length. This is called for every char of a command outside of a
+	// payload, before it is added to the keyword. Blocks can only start at
+	// the beginning of a parameter
+	void addBlockHeaderChar(const char c) {
+
+		if (!blocksEnabled()) return;
+
+		const bool digit = c >= '0' && c <= '9';
+
+		if (_blockState == BLOCK_PARAM_START && c == '#') {
+			_blockState = BLOCK_HASH;
+		}
+		// "#0" starts an indefinite length block, which isn't supported
+		else if (_blockState == BLOCK_HASH && digit && c != '0') {
+			_blockDigits = c - '0';
+			_blockRemaining = 0;
+			_blockState = BLOCK_LENGTH;
+		}
+		else if (_blockState == BLOCK_LENGTH && digit) {
+			_blockRemaining = _blockRemaining * 10 + (c - '0');
+
+			if (--_blockDigits == 0) startBlock();
+		}
+		// Anything else isn't a block header, e.g. "#H1F". A delimiter after
+		// the keyword means a new parameter may start with the next char
+		else if (ParameterTable::isDelimiter(c) && _keywordState != KEYWORD_NOT_STARTED) {
+			_blockState = BLOCK_PARAM_START;
+		}
+		else {
+			_blockState = BLOCK_NONE;
+		}
+	}
+
+	// The header of a block is complete, so receive its payload
+	void startBlock() {
+
+		CONSOLE_LOG(F("CommandHandler::Block of length "));
+		CONSOLE_LOG_LN(_blockRemaining);
+
+		// Each payload is stored at the start of the buffer, so it mustn't
+		// overwrite one which is still waiting to be used
+		if (_blockBuffer && _blocksWaiting > 0 && !_command_too_long && !_command_not_found) {
+			CONSOLE_LOG_LN(F("ERROR: block buffer in use!"));
+			_block_buffer_busy = true;
+			_command_too_long = true;
+		}
+
+		_blockOffset = 0;
+		_blockState = BLOCK_PAYLOAD;
+
+		if (_blockRemaining == 0) endBlock();
+	}
+
+	// Receive chars of a block's payload, up to the end of the block. Returns
+	// the number of chars used from `data`
+	size_t addBlockChars(const char* data, size_t len) {
+
+		const size_t n = len < _blockRemaining ? len : _blockRemaining;
+
+		// The payload of a discarded command is skipped, but must still be
+		// counted so that any newlines in it are not taken as the end of it
+		if (!_command_too_long && !_command_not_found) {
+
+			if (_blockSink) {
+				_blockSink(data, n, _blockOffset);
+			}
+			else if (_blockOffset + n <= _blockBufferSize) {
+				memcpy(_blockBuffer + _blockOffset, data, n);
+			}
+			else {
+				CONSOLE_LOG_LN(F("ERROR: block too long!"));
+				_command_too_long = true;
 			}
+		}
 
-			CONSOLE_LOG_LN(F("Calling function..."));
-			f(params);
+		_blockOffset += n;
+		_blockRemaining -= n;
 
-			return CommandHandlerReturn::NO_ERROR;
+		if (_blockRemaining == 0) endBlock();
+
+		return n;
+	}
+
+	// The payload of a block is complete. The command then continues as usual
+	void endBlock() {
+		_blockState = BLOCK_NONE;
+		_blockReceived = _blockOffset;
+	}
+#endif
+
+#ifdef COMMAND_STREAMING
+	// A command whose params are passed to a function as they arrive
+	struct streamingCommand {
+		uint32_t hash; // Hash of the keyword
+		streamFunction* f; // Function which receives the params
+	};
+
+	// The streaming command with the given hash, or NULL if there isn't one
+	const streamingCommand* findStream(uint32_t hash) const {
+
+		for (uint8_t i = 0; i < _streamsIdx; i++) {
+			if (_streams[i].hash == hash) return &_streams[i];
 		}
 
-	protected:
-
-		dataStruct _commands[array_size];
-		unsigned int _commandsIdx;
-
-		// ----------------------------- crc32b --------------------------------
-		// (case insensitive)
-		/* This is the basic CRC-32 calculation with some optimization but no
-		table lookup. The the byte reversal is avoided by shifting the crc reg
-		right instead of left and by using a reversed 32-bit word to represent
-		the polynomial.
-		   When compiled to Cyclops with GCC, this function executes in 8 + 72n
-		instructions, where n is the number of bytes in the input message. It
-		should be doable in 4 + 61n instructions.
-		   If the inner loop is strung out (approx. 5*8 = 40 instructions),
-		it would take about 6 + 46n instructions. */
-		static uint32_t crc32b(const char *str) {
-		   int i, j;
-		   uint32_t byte, crc, mask;
-
-		   i = 0;
-		   crc = 0xFFFFFFFF;
-		   while (str[i] != 0) {
-		      byte = tolower(str[i]);            // Get next byte.
-		      crc = crc ^ byte;
-		      for (j = 7; j >= 0; j--) {    // Do eight times.
-		         mask = -(crc & 1);
-		         crc = (crc >> 1) ^ (0xEDB88320 & mask);
-		      }
-		      i = i + 1;
-		   }
-		   return ~crc;
+		return NULL;
+	}
+
+	// Add a char to the params of the streaming command being received,
+	// passing on each param when it ends
+	void addStreamChar(const char c) {
+
+		if (ParameterTable::isDelimiter(c)) {
+			endStreamParam();
 		}
-   
+		else if (_streamParamLength >= COMMAND_STREAM_PARAM_MAX - 1) {
+			CONSOLE_LOG_LN(F("ERROR: streamed param too long!"));
+			_command_too_long = true;
+		}
+		else {
+			_streamParam[_streamParamLength++] = c;
+		}
+	}
+
+	// Pass the param being received, if any, to the streaming command
+	void endStreamParam() {
+
+		if (_streamParamLength == 0) return;
+
+		_streamParam[_streamParamLength] = '\0';
+		_streamParamLength = 0;
+
+		_stream->f(_streamParam, ++_streamParamCount);
+	}
+#endif
+
+	// The queue entry for the command currently being received. This is only
+	// valid while the queue is not full
+	queuedCommand& receivingCommand() {
+		return _queue[(_queueHead + _queueCount) % queue_size];
+	}
+
+	// Add the command currently being received to the queue of waiting
+	// commands and start a new one after it. `end` is the char which ended
+	// the command. With COMMAND_SCPI_TREE, empty commands which SCPI allows
+	// are dropped instead
+	void pushCommand(const char end) {
+
+#ifdef COMMAND_SCPI_TREE
+		// SCPI allows empty commands between ';'s and after the last ';' on a
+		// line, e.g. ":SOUR:VOLT?;", so these aren't queued
+		if (_keywordState == KEYWORD_NOT_STARTED && !_command_too_long &&
+			(end == ';' || _afterSeparator)) {
+			dropEmptyCommand(end);
+			return;
+		}
+
+		_afterSeparator = end == ';';
+#endif
+
+		queuedCommand& cmd = receivingCommand();
+
+#ifdef COMMAND_RESPONSES
+		cmd.endsLine = end == '\n';
+#else
+		(void)end;
+#endif
+
+		// The keyword may have been ended by the newline
+		if (_keywordState == KEYWORD_STARTED) endKeyword();
+
+#ifdef COMMAND_SCPI_TREE
+		// A command with no keyword isn't in the tree
+		if (_keywordState == KEYWORD_NOT_STARTED) cmd.node = NULL;
+#endif
+
+		const bool discarded = _command_too_long || _command_not_found;
+
+#ifdef COMMAND_STREAMING
+		// Pass on the last param of a streaming command, then report its end
+		cmd.streamed = _stream != NULL;
+
+		if (_stream && !discarded) {
+			endStreamParam();
+			_stream->f(NULL, _streamParamCount);
+		}
+
+		_stream = NULL;
+		_streamParamLength = 0;
+		_streamParamCount = 0;
+#endif
+
+		cmd.start = _lineStart;
+		cmd.length = discarded ? 0 : _bufferLength;
+
+		if (_command_not_found)
+			cmd.error = CommandHandlerReturn::COMMAND_NOT_FOUND;
+#ifdef COMMAND_BLOCK_PARAMETERS
+		else if (_block_buffer_busy)
+			cmd.error = CommandHandlerReturn::BUFFER_FULL;
+#endif
+		else if (_command_too_long)
+			cmd.error = CommandHandlerReturn::COMMAND_TOO_LONG;
+		else
+			cmd.error = CommandHandlerReturn::NO_ERROR;
+
+		// Discarded commands are not stored, so only keep the null terminator
+		_inputBuffer[cmd.start + cmd.length] = '\0';
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+		cmd.block = discarded ? -1 : _blockReceived;
+		if (cmd.block >= 0) _blocksWaiting++;
+
+		_blockState = BLOCK_NONE;
+		_blockReceived = -1;
+		_block_buffer_busy = false;
+#endif
+
+		_queueCount++;
+
+		// Start the next command after this one
+		_lineStart = cmd.start + cmd.length + 1;
+		_bufferLength = 0;
+		_command_too_long = false;
+		_command_not_found = false;
+		_keywordState = KEYWORD_NOT_STARTED;
+		_keywordCrc = CRC32_INITIAL;
+
+		if (_lineStart < sizeof(_inputBuffer)) {
+			_inputBuffer[_lineStart] = '\0';
+		}
+
+#ifdef COMMAND_INCREMENTAL_PARSING
+		if (!bufferFull()) {
+			receivingCommand().params.clear();
+		}
+#endif
+	}
+
+#ifdef COMMAND_SCPI_TREE
+	// Forget an empty command, which holds at most some whitespace, instead of
+	// queueing it. `end` is the char which ended the command
+	void dropEmptyCommand(const char end) {
+
+		_bufferLength = 0;
+
+		if (_lineStart < sizeof(_inputBuffer)) {
+			_inputBuffer[_lineStart] = '\0';
+		}
+
+#ifdef COMMAND_INCREMENTAL_PARSING
+		receivingCommand().params.clear();
+#endif
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+		_blockState = BLOCK_NONE;
+#endif
+
+		if (end != '\n') return;
+
+		_afterSeparator = false;
+
+#ifdef COMMAND_RESPONSES
+		// The line has ended, so its replies can be written out once its last
+		// command has been executed, or now if it already has been
+		if (_queueCount > 0)
+			_queue[(_queueHead + _queueCount - 1) % queue_size].endsLine = true;
+		else
+			_response.endLine();
+#endif
+	}
+#endif
+
+	// Remove the oldest waiting command from the queue
+	void popCommand() {
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+		if (_queue[_queueHead].block >= 0) _blocksWaiting--;
+#endif
+
+		_queueHead = (_queueHead + 1) % queue_size;
+		_queueCount--;
+
+		// If nothing is using the buffer, start again at the beginning
+		if (_queueCount == 0 && _bufferLength == 0 && !_command_too_long &&
+			!_command_not_found) {
+			_lineStart = 0;
+			_inputBuffer[0] = '\0';
+		}
+
+#ifdef COMMAND_INCREMENTAL_PARSING
+		// If the queue was full, no command was being received
+		if (_queueCount == queue_size - 1) {
+			receivingCommand().params.clear();
+		}
+#endif
+	}
+
+	// An object for handling the matching of commands -> functions
+	Lookup _lookupList;
+
+	// Ring of commands waiting to be executed, oldest first
+	queuedCommand _queue[queue_size];
+	size_t _queueHead;
+	size_t _queueCount;
+
+	// A buffer for receiving new commands. Waiting commands are stored end to
+	// end, followed by the command currently being received
+	char _inputBuffer[queue_size * (buffer_size + 1)];
+	index_t _lineStart;
+	index_t _bufferLength;
+
+	// A flag to report that the command currently being received has overrun
+	bool _command_too_long;
+
+	// A flag to report that the keyword of the command currently being
+	// received is not registered
+	bool _command_not_found;
+
+	// Progress through the keyword of the command currently being received
+	enum keywordState {
+		KEYWORD_NOT_STARTED,
+		KEYWORD_STARTED,
+		KEYWORD_DONE
+	};
+	keywordState _keywordState;
+
+	// CRC of the keyword so far
+	uint32_t _keywordCrc;
+
+#ifdef COMMAND_SCPI_TREE
+	// Position in the tree of commands of the header being received
+	ScpiPath _path;
+
+	// A flag to report that the last command was ended by a ';', so an empty
+	// command after it is allowed
+	bool _afterSeparator;
+#endif
+
+#ifdef COMMAND_BLOCK_PARAMETERS
+	// Where the payloads of blocks are sent: either a function or a buffer
+	blockFunction* _blockSink;
+	char* _blockBuffer;
+	size_t _blockBufferSize;
+
+	// Progress through a block in the command currently being received
+	enum blockState {
+		BLOCK_NONE,
+		BLOCK_PARAM_START, // A new parameter may start with the next char
+		BLOCK_HASH, // Received '#'
+		BLOCK_LENGTH, // Receiving the digits of the length
+		BLOCK_PAYLOAD
 	};
+	blockState _blockState;
+
+	// Digits of the length still to come
+	uint8_t _blockDigits;
+
+	// Length of the payload, then the number of its chars still to come
+	uint32_t _blockRemaining;
+
+	// Number of chars of the payload received so far
+	uint32_t _blockOffset;
+
+	// Length of the block in the command currently being received, or -1
+	long _blockReceived;
+
+	// Number of waiting commands which have a block
+	size_t _blocksWaiting;
+
+	// A flag to report that the block buffer was in use by a waiting command
+	bool _block_buffer_busy;
+#endif
+
+#ifdef COMMAND_RESPONSES
+	// Buffer for the replies of commands
+	CommandResponse _response;
+#endif
+
+#ifdef COMMAND_TRANSMIT_RING
+	// Replies waiting to be transmitted
+	TransmitRing _transmit;
+
+	static_assert(COMMAND_TRANSMIT_SIZE > COMMAND_RESPONSE_SIZE_MAX,
+		"The transmit ring must be larger than the response buffer");
+#endif
+
+#ifdef COMMAND_ISR_RECEIVE
+	// Chars received by `addCommandCharFromISR()`, waiting to be processed
+	ReceiveRing<COMMAND_RECEIVE_SIZE> _receive;
+#endif
+
+#ifdef COMMAND_STREAMING
+	// Registered streaming commands
+	streamingCommand _streams[COMMAND_STREAMING_MAX];
+	uint8_t _streamsIdx;
+
+	// The streaming command currently being received, or NULL
+	const streamingCommand* _stream;
+
+	// The param of the streaming command currently being received
+	char _streamParam[COMMAND_STREAM_PARAM_MAX];
+	BufferIndex<COMMAND_STREAM_PARAM_MAX>::type _streamParamLength;
+
+	// Number of params passed on so far
+	unsigned int _streamParamCount;
+#endif
 };
 
+// The usual CommandHandler, which holds up to <array_size> commands in RAM
+template <size_t array_size, size_t queue_size = 1, size_t buffer_size = COMMAND_SIZE_MAX>
+using CommandHandler = BasicCommandHandler<CommandLookup<array_size>, queue_size, buffer_size>;
+
+// A CommandHandler which uses the commands in `*lookup`, shared with other
+// handlers, instead of holding its own. See SharedCommandLookup
+template <class Lookup, Lookup* lookup, size_t queue_size = 1, size_t buffer_size = COMMAND_SIZE_MAX>
+using SharedCommandHandler = BasicCommandHandler<SharedCommandLookup<Lookup, lookup>,
+	queue_size, buffer_size>;
@@ -0,0 +1,381 @@
+#pragma once
+
+// This file implements a buffer for the replies to commands, e.g.
+//
+//     void getVoltage(const ParameterLookup& params) {
+//       params.response().printFixed(millivolts, 3);
+//     }
+//
+// Replies are collected in a buffer of COMMAND_RESPONSE_SIZE_MAX chars and
+// written to the output (e.g. `Serial`) in one go when the line of commands
+// ends, instead of with a call to the driver for every `print()`. This matters
+// most on USB serial ports, where each write may take a whole 1 ms frame. If
+// the buffer fills up, it is written out early.
+//
+// If several commands on one line reply, e.g. "VOLT?;CURR?" with
+// COMMAND_SCPI_TREE set, their replies are joined by ';' into a single line,
+// "1.000;0.250", as SCPI requires.
+//
+// CommandResponse is a Print, so anything that can be printed to Serial can be
+// printed to it. `printInt()`, `printFixed()` and `printFloat()` format
+// numbers without dividing, which is slow on 8 bit processors.
+//
+// Writing to Serial still blocks if its transmit buffer (64 bytes on AVR) is
+// full. To avoid this, replies can be passed through a TransmitRing, which
+// holds them until `service()` finds room for them in the output.
+
+#include <Arduino.h>
+#include <math.h>
+
+// num chars to reserve in memory for replies
+#ifndef COMMAND_RESPONSE_SIZE_MAX
+#define COMMAND_RESPONSE_SIZE_MAX 64
+#endif
+
+// num chars to reserve in memory for replies waiting to be transmitted
+#ifndef COMMAND_TRANSMIT_SIZE
+#define COMMAND_TRANSMIT_SIZE 128
+#endif
+
+// Powers of ten used to format numbers, largest first
+static const uint32_t response_powers_of_10[] PROGMEM = {
+  1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL, 10000UL,
+  1000UL, 100UL, 10UL
+};
+
+class CommandResponse : public Print {
+
+public:
+
+  CommandResponse() :
+    _output(NULL), _length(0), _lineStarted(false), _commandStarted(false)
+  {}
+
+  // Set where replies are written, e.g. `setOutput(&Serial)`. If there is no
+  // output, replies are discarded
+  void setOutput(Print* output) { _output = output; }
+
+  using Print::write;
+
+  size_t write(uint8_t c) {
+    startReply();
+    put(c);
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t length) {
+
+    if (length == 0) return 0;
+
+    startReply();
+
+    for (size_t done = 0; done < length;) {
+
+      if (_length >= COMMAND_RESPONSE_SIZE_MAX) flush();
+
+      size_t chunk = COMMAND_RESPONSE_SIZE_MAX - _length;
+      if (chunk > length - done) chunk = length - done;
+
+      memcpy(_buffer + _length, data + done, chunk);
+      _length += chunk;
+      done += chunk;
+    }
+
+    return length;
+  }
+
+  // Print an integer in decimal
+  void printInt(int32_t value) {
+
+    uint32_t magnitude = value;
+
+    if (value < 0) {
+      write('-');
+      magnitude = 0 - magnitude;
+    }
+
+    writeFixed(magnitude, 0);
+  }
+
+  // Print a number in units of 10^-scale with `scale` decimal places, e.g.
+  // `printFixed(1500, 3)` prints "1.500". This suits the values given by
+  // `ScpiNumber::toFixed()`. The scale can be at most 9
+  void printFixed(int32_t value, uint8_t scale) {
+
+    uint32_t magnitude = value;
+
+    if (value < 0) {
+      write('-');
+      magnitude = 0 - magnitude;
+    }
+
+    writeFixed(magnitude, scale > 9 ? 9 : scale);
+  }
+
+  // Print a float with `decimals` decimal places, rounding the last one.
+  // Values too large to be formatted quickly are passed to `Print::print()`
+  void printFloat(float value, uint8_t decimals = 2) {
+
+    if (isnan(value)) {
+      write("nan");
+      return;
+    }
+
+    if (isinf(value)) {
+      write(value < 0 ? "-inf" : "inf");
+      return;
+    }
+
+    if (decimals > 9) decimals = 9;
+
+    const float scale = decimals ? pgm_read_dword(&response_powers_of_10[9 - decimals]) : 1;
+    const float scaled = (value < 0 ? -value : value) * scale + 0.5f;
+
+    if (scaled >= 4294967040.0f) {
+      print(value, decimals);
+      return;
+    }
+
+    const uint32_t magnitude = scaled;
+
+    // Don't print "-0.00"
+    if (value < 0 && magnitude) write('-');
+
+    writeFixed(magnitude, decimals);
+  }
+
+  // Start the reply to the next command on the same line. If it replies, a
+  // ';' is written first to separate it from any earlier replies
+  void nextCommand() { _commandStarted = false; }
+
+  // End the line of commands: if anything was replied, write it to the
+  // output followed by a newline
+  void endLine() {
+
+    if (_lineStarted) put('\n');
+
+    flush();
+
+    _lineStarted = false;
+    _commandStarted = false;
+  }
+
+  // Write any waiting chars to the output now, without ending the line
+  void flush() {
+
+    if (_output && _length) _output->write((const uint8_t*)_buffer, _length);
+
+    _length = 0;
+  }
+
+  // Number of chars waiting to be written
+  size_t length() const { return _length; }
+
+private:
+
+  // Called before each part of a reply, to separate it from the replies of
+  // earlier commands on the line
+  void startReply() {
+
+    if (_commandStarted) return;
+
+    if (_lineStarted) put(';');
+
+    _lineStarted = true;
+    _commandStarted = true;
+  }
+
+  // Add a char to the buffer, writing out the buffer first if it's full
+  void put(const char c) {
+
+    if (_length >= COMMAND_RESPONSE_SIZE_MAX) flush();
+
+    _buffer[_length++] = c;
+  }
+
+  // Print `magnitude` / 10^scale with `scale` decimal places
+  void writeFixed(uint32_t magnitude, uint8_t scale) {
+
+    char digits[10];
+    const uint8_t n = formatDigits(magnitude, digits, scale + 1);
+
+    write(digits, n - scale);
+
+    if (scale) {
+      write('.');
+      write(digits + n - scale, scale);
+    }
+  }
+
+  // Write the decimal digits of `value` to `digits`, with leading zeros to
+  // make at least `minDigits` of them. Each digit is found by subtracting
+  // powers of ten. Returns the number of digits
+  static uint8_t formatDigits(uint32_t value, char* digits, uint8_t minDigits) {
+
+    uint8_t n = 0;
+
+    for (uint8_t i = 0; i < 9; i++) {
+
+      const uint32_t power = pgm_read_dword(&response_powers_of_10[i]);
+      char digit = '0';
+
+      while (value >= power) {
+        value -= power;
+        digit++;
+      }
+
+      // Skip leading zeros, unless they are needed to make up minDigits
+      if (n || digit != '0' || 10 - i <= minDigits) digits[n++] = digit;
+    }
+
+    digits[n++] = '0' + value;
+
+    return n;
+  }
+
+  // Where replies are written
+  Print* _output;
+
+  // Replies waiting to be written
+  char _buffer[COMMAND_RESPONSE_SIZE_MAX];
+  size_t _length;
+
+  // Has anything been replied on this line, and by the current command?
+  bool _lineStarted;
+  bool _commandStarted;
+};
+
+// This class holds chars waiting to be written to an output, such as Serial,
+// in a ring buffer of COMMAND_TRANSMIT_SIZE chars. Writing to it never
+// blocks: chars which don't fit are dropped, apart from the newline at the end
+// of the line, and `overflowed()` is set until `clearOverflow()` is called.
+// If there is no output, chars are discarded.
+//
+// `service()` then writes as many as the output has room for, which it finds
+// from `availableForWrite()`. Many outputs don't implement this, and Print's
+// version always returns 0. Until the output has reported some room, it is
+// assumed not to know, and waiting chars are written to it all at once, even
+// if that blocks
+class TransmitRing : public Print {
+
+public:
+
+  TransmitRing() :
+    _output(NULL), _head(0), _count(0), _overflowed(false), _reportsRoom(false)
+  {}
+
+  // Set where the chars are written, e.g. `setOutput(&Serial)`
+  void setOutput(Print* output) {
+    _output = output;
+    _reportsRoom = false;
+  }
+
+  using Print::write;
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t length) {
+
+    if (length == 0) return 0;
+
+    // Nowhere to send them
+    if (!_output) return length;
+
+    if (!_overflowed && length <= space()) {
+      copyIn(data, length);
+      return length;
+    }
+
+    // The rest of the reply is dropped, but a char is kept free for the
+    // newline which ends it, so that the next line still starts cleanly
+    size_t written = 0;
+
+    if (!_overflowed && space() > 1) {
+      written = space() - 1;
+      copyIn(data, written);
+    }
+
+    _overflowed = true;
+
+    if (data[length - 1] == '\n' && space() > 0) {
+      copyIn(data + length - 1, 1);
+      written++;
+    }
+
+    return written;
+  }
+
+  // Write waiting chars to the output, as far as it has room for them
+  // without blocking. Call this regularly, e.g. in `loop()`
+  void service() {
+
+    while (_output && _count) {
+
+      // Write up to the end of the buffer, then wrap around
+      size_t chunk = COMMAND_TRANSMIT_SIZE - _head;
+      if (chunk > _count) chunk = _count;
+
+      const int room = _output->availableForWrite();
+
+      if (room > 0) {
+        _reportsRoom = true;
+        if (chunk > (size_t)room) chunk = room;
+      }
+      else if (_reportsRoom) {
+        // The output is full
+        return;
+      }
+
+      chunk = _output->write((const uint8_t*)_buffer + _head, chunk);
+      if (chunk == 0) return;
+
+      _head = (_head + chunk) % COMMAND_TRANSMIT_SIZE;
+      _count -= chunk;
+    }
+  }
+
+  // Number of chars which can be written without overflowing
+  size_t space() const { return COMMAND_TRANSMIT_SIZE - _count; }
+
+  // Number of chars waiting to be written to the output
+  size_t waiting() const { return _count; }
+
+  // Have any chars been dropped since `clearOverflow()` was last called?
+  bool overflowed() const { return _overflowed; }
+
+  void clearOverflow() { _overflowed = false; }
+
+private:
+
+  // Add chars to the end of the ring, which must have room for them
+  void copyIn(const uint8_t* data, size_t length) {
+
+    for (size_t done = 0; done < length;) {
+
+      // Copy up to the end of the buffer, then wrap around
+      const size_t end = (_head + _count) % COMMAND_TRANSMIT_SIZE;
+      size_t chunk = COMMAND_TRANSMIT_SIZE - end;
+      if (chunk > length - done) chunk = length - done;
+
+      memcpy(_buffer + end, data + done, chunk);
+      _count += chunk;
+      done += chunk;
+    }
+  }
+
+  // Where the chars are written
+  Print* _output;
+
+  // Ring of waiting chars, starting at `_head`
+  char _buffer[COMMAND_TRANSMIT_SIZE];
+  size_t _head;
+  size_t _count;
+
+  // A flag to report that chars were dropped
+  bool _overflowed;
+
+  // Has the output ever reported room with `availableForWrite()`?
+  bool _reportsRoom;
+};
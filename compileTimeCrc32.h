@@ -10,7 +10,8 @@
 // "no matching function for call to 'ct()'"
 
 // CRC32 Table (zlib polynomial)
-static constexpr uint32_t crc_table[256] = {
+// This is stored in flash: at runtime it must be read with pgm_read_dword()
+static constexpr uint32_t crc_table[256] PROGMEM = {
   0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
   0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
   0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
@@ -70,18 +71,26 @@ constexpr char tolower_const(const char c) {
     return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
 }
 
-// A recursive function that calculates the case insensitive hash of the input string
-template<size_t idx>
-constexpr uint32_t crc32(const char * str)
+// Adds one char to the CRC register
+constexpr uint32_t crc32_step(uint32_t crc, const char c)
+{
+  return (crc >> 8) ^ crc_table[(crc ^ tolower_const(c)) & 0x000000FF];
+}
+
+// Calculates the case insensitive hash of chars [idx, len) of the input
+// string, starting with `crc` in the CRC register. This recurses once per char,
+// so the compile time is linear in the length of the string
+constexpr uint32_t crc32_from(const char * str, size_t idx, size_t len, uint32_t crc)
 {
-  return (crc32<idx - 1>(str) >> 8) ^ crc_table[(crc32<idx - 1>(str) ^ tolower_const(str[idx])) & 0x000000FF];
+  return idx == len ? crc :
+    crc32_from(str, idx + 1, len, crc32_step(crc, str[idx]));
 }
 
-// This is the stop-recursion function
-template<>
-constexpr uint32_t crc32<size_t(-1)>(const char * str)
+// Calculates the case insensitive hash of chars [0, idx] of the input string
+template<size_t idx>
+constexpr uint32_t crc32(const char * str)
 {
-  return 0xFFFFFFFF;
+  return crc32_from(str, 0, idx + 1, 0xFFFFFFFF);
 }
 
 // This is the call to the CRC32 chain
@@ -99,4 +108,37 @@ constexpr T ct() { return V; }
 // Here we call the CRC32 function and pass the output via the template cheat
 // if you get the error "no matching function for call to 'ct()'" then this is because
 // the compiler can't figure out the hash at compile time. Ensure that x is a constexpr
-#define COMMANDHANDLER_HASH(x) ct<long, DO_RUNTIME_CRC32_HASH(x)>()
\ No newline at end of file
+#define COMMANDHANDLER_HASH(x) ct<long, DO_RUNTIME_CRC32_HASH(x)>()
+
+// SCPI mnemonics have a long and a short form, written in mixed case as e.g.
+// "VOLTage". The short form is the upper case part and any following
+// non-letters, e.g. "VOLTage?" -> "VOLT?". Levels of a header separated by
+// colons each have their own short form, e.g. "SOURce:VOLTage" -> "SOUR:VOLT".
+// A level with no upper case letters, e.g. "volt", is its own short form
+
+// Does the level of a header which starts at `idx` contain upper case letters?
+constexpr bool scpi_level_has_upper(const char * str, size_t idx, size_t len)
+{
+  return (idx == len || str[idx] == ':') ? false :
+    (str[idx] >= 'A' && str[idx] <= 'Z') || scpi_level_has_upper(str, idx + 1, len);
+}
+
+// Calculates the case insensitive hash of the short form of chars [idx, len)
+// of the input string. If `dropLower` is set, lower case letters in the current
+// level are skipped
+constexpr uint32_t crc32_short_from(const char * str, size_t idx, size_t len, bool dropLower, uint32_t crc)
+{
+  return idx == len ? crc :
+    crc32_short_from(str, idx + 1, len,
+      str[idx] == ':' ? scpi_level_has_upper(str, idx + 1, len) : dropLower,
+      (dropLower && str[idx] >= 'a' && str[idx] <= 'z') ? crc : crc32_step(crc, str[idx]));
+}
+
+// Hash of the short form of a SCPI header. As for DO_RUNTIME_CRC32_HASH, don't
+// use this unless you want the hash to be performed at runtime
+#define DO_RUNTIME_CRC32_SHORT_HASH(x) \
+  (crc32_short_from(x, 0, sizeof(x) - 1, scpi_level_has_upper(x, 0, sizeof(x) - 1), 0xFFFFFFFF) ^ 0xFFFFFFFF)
+
+// Compile time hash of the short form of a SCPI header, e.g.
+// COMMANDHANDLER_SHORT_HASH("SOURce:VOLTage") == COMMANDHANDLER_HASH("sour:volt")
+#define COMMANDHANDLER_SHORT_HASH(x) ct<long, DO_RUNTIME_CRC32_SHORT_HASH(x)>()
@@ -1,4 +1,5 @@
 #include <CommandHandler.h>
+#include <typedCommand.h>
 
 // Create a CommandHandler object to hold 5 commands
 CommandHandler<5> h;
@@ -11,7 +12,7 @@ CommandHandler<5> h;
 commandFunction helloWorld; // "hello"
 commandFunction helloWorldQ; // "hello?"
 commandFunction echoMe; // "echo"
-commandFunction adder; // "add"
+void adder(float first, float second); // "add"
 commandFunction echoMany; // "echoMany"
 
 ///////////////////////////////////////////////////////
@@ -34,7 +35,11 @@ void setup() {
 	h.registerCommand(COMMANDHANDLER_HASH( "heLLo" ), 0, helloWorld);
 	h.registerCommand(COMMANDHANDLER_HASH( "hello?"), 0, helloWorldQ);
 	h.registerCommand(COMMANDHANDLER_HASH( "eCHo"), 1, echoMe);
-	h.registerCommand(COMMANDHANDLER_HASH( "add"), 2, adder);
+
+	// Functions can also take typed parameters instead of a ParameterLookup.
+	// TYPED_COMMAND gives the number of parameters and converts them before
+	// calling the function
+	h.registerCommand(COMMANDHANDLER_HASH( "add"), TYPED_COMMAND(adder));
 
 	// Setting num params to "-1" will allow any number of params to be passed
 	h.registerCommand(COMMANDHANDLER_HASH( "echoMany"), -1, echoMany);
@@ -60,6 +65,11 @@ void loop() {
 			Serial.println(F("Wrong number of params"));
 			break;
 
+		case CommandHandlerReturn::INVALID_PARAMETER:
+
+			Serial.println(F("Invalid param"));
+			break;
+
 		default:
 
 			Serial.print(F("Error code "));
@@ -103,14 +113,8 @@ void echoMe(const ParameterLookup& params) {
 }
 
 // Add two numbers
-// 2 params
-void adder(const ParameterLookup& params) {
-
-	// Convert the first parameter to a number
-	double first = atof(params[1]);
-
-	// And the second
-	double second = atof(params[2]);
+// 2 params, which have already been converted to numbers
+void adder(float first, float second) {
 
 	// Add and output
 	Serial.print(F("Sum of "));
@@ -0,0 +1,79 @@
+#define COMMAND_SCPI_TREE
+#define COMMAND_RESPONSES
+#include <CommandHandler.h>
+#include <scpiNumber.h>
+
+// Replies to several SCPI queries on one line with a single line, e.g.
+//
+//   > :SOUR:VOLT?;CURR?
+//   < 5.000;0.250
+//
+// The replies are collected by CommandHandler and written to Serial in one
+// go at the end of each line. The voltage can be set in volts, with or without
+// units, e.g. ":SOUR:VOLT 2.5" or ":SOUR:VOLT 2500mV"
+
+int32_t millivolts = 5000;
+float amps = 0.25;
+
+///////////////////////////////////////////////////////
+// Declare functions to be called by serial commands //
+///////////////////////////////////////////////////////
+
+commandFunction setVoltage; // ":SOURce:VOLTage"
+commandFunction getVoltage; // ":SOURce:VOLTage?"
+commandFunction getCurrent; // ":SOURce:CURRent?"
+
+const ScpiNode sourceNodes[] PROGMEM = {
+	SCPI_COMMAND("VOLTage", 1, &setVoltage),
+	SCPI_COMMAND("VOLTage?", 0, &getVoltage),
+	SCPI_COMMAND("CURRent?", 0, &getCurrent)
+};
+
+const ScpiNode rootNodes[] PROGMEM = {
+	SCPI_BRANCH("SOURce", sourceNodes)
+};
+
+///////////////////////////////////////////////////////
+//             End function declaration              //
+///////////////////////////////////////////////////////
+
+CommandHandler<0, 4> h;
+
+void setup() {
+
+	Serial.begin(57600);
+
+	h.setCommandTree(rootNodes);
+	h.setResponseOutput(Serial);
+}
+
+void loop() {
+
+	h.poll(Serial);
+
+	while (h.commandWaiting()) {
+		h.executeCommand();
+	}
+}
+
+void setVoltage(const ParameterLookup& params) {
+
+	ScpiNumber volts;
+	int32_t value;
+
+	if (parseScpiNumber(params[1], volts, "V") != CommandHandlerReturn::NO_ERROR ||
+		volts.toFixed(3, value) != CommandHandlerReturn::NO_ERROR) {
+		params.setError(CommandHandlerReturn::INVALID_PARAMETER);
+		return;
+	}
+
+	millivolts = value;
+}
+
+void getVoltage(const ParameterLookup& params) {
+	params.response().printFixed(millivolts, 3);
+}
+
+void getCurrent(const ParameterLookup& params) {
+	params.response().printFloat(amps, 3);
+}
@@ -0,0 +1,185 @@
+#include <CommandHandler.h>
+
+// Compares the runtime crc32 implementations in runtimeCrc32.h
+//
+// First, every one and two char string is hashed with each implementation to
+// check that they all agree, and that they match the compile time hashes used
+// by COMMANDHANDLER_HASH and COMMANDHANDLER_SHORT_HASH. Then each
+// implementation is timed
+//
+// The compile time hash reads its table straight from flash, which only works
+// at compile time on AVR. So the compile time hashes of every string are summed
+// into a digest by the compiler, which is checked against the same sum of the
+// runtime hashes. This makes the sketch take a few seconds to compile
+
+// Number of times to hash each keyword when timing
+const int NUM_REPEATS = 1000;
+
+constexpr char keyword1[] = "*idn?";
+constexpr char keyword2[] = "SOURce:VOLTage";
+constexpr char keyword3[] = "MEASure:CURRent:DC?";
+
+// Signature of the functions being compared
+typedef uint32_t crcUpdateFunction(uint32_t crc, const char c);
+
+// Number of one and two char strings, which are numbered from 0
+const unsigned int NUM_STRINGS = 255 * 256;
+
+// The string numbered `i`, and its length
+struct TestString {
+  char chars[3];
+  size_t length;
+};
+
+constexpr TestString testString(unsigned int i) {
+  return TestString{ { (char)(1 + i / 256), (char)(i % 256), '\0' }, i % 256 ? 2u : 1u };
+}
+
+// Compile time hashes of a string, as COMMANDHANDLER_HASH and
+// COMMANDHANDLER_SHORT_HASH calculate them
+constexpr uint32_t compileTimeHash(const TestString s) {
+  return crc32_from(s.chars, 0, s.length, CRC32_INITIAL) ^ 0xFFFFFFFF;
+}
+
+constexpr uint32_t compileTimeShortHash(const TestString s) {
+  return crc32_short_from(s.chars, 0, s.length,
+    scpi_level_has_upper(s.chars, 0, s.length), CRC32_INITIAL) ^ 0xFFFFFFFF;
+}
+
+// Adds the hash of string `i` to a digest. The hash is mixed with `i` so that
+// swapping the hashes of two strings changes the digest
+constexpr uint32_t digestTerm(unsigned int i, uint32_t hash) {
+  return hash ^ (i * 2654435761UL);
+}
+
+// Digest of the compile time hashes of strings [lo, hi). This splits the range
+// in half so that the recursion depth stays small
+constexpr uint32_t compileTimeDigest(unsigned int lo, unsigned int hi, bool shortForm) {
+  return hi - lo == 1 ?
+    digestTerm(lo, shortForm ? compileTimeShortHash(testString(lo)) : compileTimeHash(testString(lo))) :
+    compileTimeDigest(lo, lo + (hi - lo) / 2, shortForm) + compileTimeDigest(lo + (hi - lo) / 2, hi, shortForm);
+}
+
+constexpr uint32_t HASH_DIGEST = compileTimeDigest(0, NUM_STRINGS, false);
+constexpr uint32_t SHORT_HASH_DIGEST = compileTimeDigest(0, NUM_STRINGS, true);
+
+///////////////////////////////////////////////////////
+//             End variable declaration              //
+///////////////////////////////////////////////////////
+
+uint32_t hashWith(crcUpdateFunction* update, const char* str) {
+
+  uint32_t crc = CRC32_INITIAL;
+
+  while (*str) {
+    crc = update(crc, *str++);
+  }
+
+  return crc32_final(crc);
+}
+
+// Copy the SCPI short form of `str` into `result`: in each level with upper
+// case letters, the lower case letters are dropped
+void shortForm(const char* str, char* result) {
+
+  while (*str) {
+
+    const char* end = str;
+    bool hasUpper = false;
+
+    while (*end && *end != ':') {
+      hasUpper |= (*end >= 'A' && *end <= 'Z');
+      end++;
+    }
+
+    for (; str != end; str++) {
+      if (!(hasUpper && *str >= 'a' && *str <= 'z')) {
+        *result++ = *str;
+      }
+    }
+
+    if (*str == ':') {
+      *result++ = *str++;
+    }
+  }
+
+  *result = '\0';
+}
+
+// Print the time taken per byte by an implementation
+void timeImplementation(const __FlashStringHelper* name, crcUpdateFunction* update) {
+
+  volatile uint32_t result = 0;
+  const size_t numBytes = NUM_REPEATS * strlen(keyword2);
+
+  unsigned long start = micros();
+
+  for (int i = 0; i < NUM_REPEATS; i++) {
+    result ^= hashWith(update, keyword2);
+  }
+
+  unsigned long elapsed = micros() - start;
+
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print((float)elapsed * (F_CPU / 1000000) / numBytes);
+  Serial.println(F(" cycles per byte"));
+}
+
+void setup() {
+
+  Serial.begin(57600);
+  Serial.println(F("Program started..."));
+
+  // Check that all implementations agree on every one and two char string,
+  // and sum their hashes to compare with the compile time hashes
+  unsigned long mismatches = 0;
+  uint32_t hashDigest = 0;
+  uint32_t shortHashDigest = 0;
+
+  for (unsigned int i = 0; i < NUM_STRINGS; i++) {
+
+    const TestString s = testString(i);
+
+    const uint32_t bitwise = hashWith(crc32_update_bitwise, s.chars);
+
+    if (bitwise != hashWith(crc32_update_nibble, s.chars) ||
+        bitwise != hashWith(crc32_update_table, s.chars)) {
+      mismatches++;
+    }
+
+    char shortChars[3];
+    shortForm(s.chars, shortChars);
+
+    hashDigest += digestTerm(i, bitwise);
+    shortHashDigest += digestTerm(i, hashWith(crc32_update, shortChars));
+  }
+
+  Serial.print(F("Mismatches between implementations: "));
+  Serial.println(mismatches);
+
+  Serial.print(F("Matches COMMANDHANDLER_HASH: "));
+  Serial.println(hashDigest == HASH_DIGEST ? F("yes") : F("no"));
+
+  Serial.print(F("Matches COMMANDHANDLER_SHORT_HASH: "));
+  Serial.println(shortHashDigest == SHORT_HASH_DIGEST ? F("yes") : F("no"));
+
+  // Check a few keywords through the macros themselves
+  const bool match =
+    hashWith(crc32_update, keyword1) == (uint32_t)COMMANDHANDLER_HASH(keyword1) &&
+    hashWith(crc32_update, keyword2) == (uint32_t)COMMANDHANDLER_HASH(keyword2) &&
+    hashWith(crc32_update, keyword3) == (uint32_t)COMMANDHANDLER_HASH(keyword3) &&
+    hashWith(crc32_update, "sour:volt") == (uint32_t)COMMANDHANDLER_SHORT_HASH(keyword2) &&
+    hashWith(crc32_update, "meas:curr:dc?") == (uint32_t)COMMANDHANDLER_SHORT_HASH(keyword3);
+
+  Serial.print(F("Keywords match: "));
+  Serial.println(match ? F("yes") : F("no"));
+
+  // Time each implementation
+  timeImplementation(F("Bitwise"), crc32_update_bitwise);
+  timeImplementation(F("Nibble table"), crc32_update_nibble);
+  timeImplementation(F("Byte table"), crc32_update_table);
+}
+
+void loop() {
+}
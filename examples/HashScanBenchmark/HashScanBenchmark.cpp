@@ -0,0 +1,123 @@
+// Compares the ways of finding a keyword's hash among 16, 256 and 4096
+// registered commands, for host programs which register thousands of them:
+//
+//   scalar scan     hash_scan_scalar() over all the hashes
+//   SIMD scan       hash_scan() over all the hashes (see hashScan.h)
+//   sorted          CommandLookup's binary search with CommandTableStructs
+//   sorted + SIMD   CommandLookup with CommandTableArrays, which scans lists
+//                   of up to COMMAND_HASH_SCAN_SIZE hashes with hash_scan()
+//   perfect hash    PerfectHash, built by the compiler. This is only done for
+//                   16 and 256 commands, since building it for 4096 is too
+//                   much for the compiler
+//
+// This runs on a host. Build it with optimisation and the SIMD instructions
+// your processor has, and with the same Arduino compatibility headers as the
+// rest of your host program, e.g.
+//
+//   g++ -O2 -march=native -std=gnu++11 -I <compat headers> -I <this library> HashScanBenchmark.cpp
+//
+// For each size, millions of lookups per second are printed
+
+#define EEPROM_DISABLED
+
+#include <chrono>
+#include <stdio.h>
+
+#include <CommandHandler.h>
+#include <perfectHash.h>
+
+// Number of lookups to time for each method and size
+const long NUM_LOOKUPS = 2000000;
+
+///////////////////////////////////////////////////////
+//             End variable declaration              //
+///////////////////////////////////////////////////////
+
+void dummy(const ParameterLookup& params) {}
+
+// The hash of keyword number `i`. These are calculated rather than hashed
+// from strings so that the compiler can build a perfect hash of them
+constexpr uint32_t mixHash(uint32_t x) { return (x ^ (x >> 16)) * 0x45d9f3bUL; }
+constexpr uint32_t keywordHash(uint32_t i) { return mixHash(mixHash(i + 1)) ^ (mixHash(mixHash(i + 1)) >> 16); }
+
+// The first `size` keyword hashes, as a HashList for PerfectHash
+template <class I>
+struct KeywordList;
+
+template <size_t... I>
+struct KeywordList<IndexSequence<I...>> {
+  typedef HashList<keywordHash(I)...> type;
+};
+
+template <size_t size>
+using Keywords = typename KeywordList<typename MakeIndexSequence<size>::type>::type;
+
+// The hashes in the order they were registered, and the order to look them up
+uint32_t hashes[4096];
+uint32_t queries[4096];
+
+// Time `find` looking up the first `size` keywords. Returns millions of
+// lookups per second
+template <class Find>
+double lookupsPerSecond(Find find, long size) {
+
+  long found = 0;
+
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < NUM_LOOKUPS; i++) {
+    found += find(queries[i % size]) >= 0;
+  }
+
+  const double us = std::chrono::duration<double, std::micro>(
+    std::chrono::steady_clock::now() - start).count();
+
+  if (found != NUM_LOOKUPS) printf("Error: only %ld commands found\n", found);
+
+  return NUM_LOOKUPS / us;
+}
+
+// Time every method except the perfect hash for `size` commands and print
+// the results
+template <size_t size>
+void benchmark() {
+
+  static CommandLookup<size> sorted;
+  static CommandLookup<size, CommandTableArrays> sortedSimd;
+
+  // Look them up in an order which the processor can't predict
+  uint32_t random = 1;
+
+  for (size_t i = 0; i < size; i++) {
+    hashes[i] = keywordHash(i);
+    sorted.registerCommand(hashes[i], 0, &dummy);
+    sortedSimd.registerCommand(hashes[i], 0, &dummy);
+
+    random = random * 1664525UL + 1013904223UL;
+    queries[i] = keywordHash(random % size);
+  }
+
+  printf("%lu\t%.1f\t%.1f\t%.1f\t%.1f",
+    (unsigned long)size,
+    lookupsPerSecond([](uint32_t h) { return hash_scan_scalar(hashes, size, h); }, size),
+    lookupsPerSecond([](uint32_t h) { return hash_scan(hashes, size, h); }, size),
+    lookupsPerSecond([](uint32_t h) { return sorted.findCommand(h); }, size),
+    lookupsPerSecond([](uint32_t h) { return sortedSimd.findCommand(h); }, size));
+}
+
+int main() {
+
+  printf("Million lookups/s, comparing %d hashes at once\n\n", HASH_SCAN_LANES);
+  printf("commands\tscalar scan\tSIMD scan\tsorted\tsorted + SIMD\tperfect hash\n");
+
+  benchmark<16>();
+  printf("\t%.1f\n", lookupsPerSecond([](uint32_t h) { return PerfectHash<Keywords<16>>::find(h); }, 16));
+
+  benchmark<256>();
+  printf("\t%.1f\n", lookupsPerSecond([](uint32_t h) { return PerfectHash<Keywords<256>>::find(h); }, 256));
+
+  benchmark<4096>();
+  printf("\tn/a\n");
+
+  return 0;
+}
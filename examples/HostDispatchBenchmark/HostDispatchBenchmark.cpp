@@ -0,0 +1,77 @@
+// Measures how the throughput of HostDispatcher scales with the number of
+// worker threads. This runs on a host, not a microcontroller, so build it
+// with the same Arduino compatibility headers as the rest of your host
+// program, e.g.
+//
+//   g++ -O2 -std=gnu++11 -pthread -I <compat headers> -I <this library> HostDispatchBenchmark.cpp
+//
+// Commands are spread over NUM_GROUPS ordering groups, as if they were for
+// that many instruments, and each takes roughly the same time to execute. For
+// 1 to the number of cores, the time to execute them all and the number of
+// commands per second are printed
+
+#define EEPROM_DISABLED
+
+#include <chrono>
+#include <stdio.h>
+
+#include <hostDispatcher.h>
+
+// Number of commands to execute for each number of threads
+const long NUM_COMMANDS = 200000;
+
+// Number of ordering groups the commands are spread over
+const int NUM_GROUPS = 64;
+
+// Amount of work done by each command
+const int WORK_PER_COMMAND = 2000;
+
+///////////////////////////////////////////////////////
+//             End variable declaration              //
+///////////////////////////////////////////////////////
+
+// A command which does some arithmetic, standing in for a simulated
+// instrument's work
+void simulate(const ParameterLookup& params) {
+
+  volatile uint32_t x = atol(params[1]);
+
+  for (int i = 0; i < WORK_PER_COMMAND; i++) {
+    x = x * 1664525UL + 1013904223UL;
+  }
+}
+
+int main() {
+
+  CommandLookup<1> commands;
+  commands.registerCommand(COMMANDHANDLER_HASH("sim"), 1, &simulate);
+
+  const unsigned int cores = std::thread::hardware_concurrency();
+
+  printf("threads\ttime (ms)\tcommands/s\n");
+
+  for (unsigned int threads = 1; threads <= (cores ? cores : 1); threads++) {
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    {
+      HostDispatcher<CommandLookup<1>> dispatcher(commands, threads);
+
+      char command[32];
+
+      for (long i = 0; i < NUM_COMMANDS; i++) {
+        snprintf(command, sizeof(command), "sim %ld", i);
+        dispatcher.submit(command, i % NUM_GROUPS);
+      }
+
+      dispatcher.wait();
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+
+    printf("%u\t%.0f\t%.0f\n", threads, ms, NUM_COMMANDS / ms * 1000);
+  }
+
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <CommandHandler.h>
+
+// Hashes 300 long keywords with COMMANDHANDLER_HASH
+//
+// This sketch doesn't do anything useful at runtime: it's here so that the
+// compile time of COMMANDHANDLER_HASH can be measured and kept in check. Build
+// it with verbose output enabled and compare the time taken against one of the
+// other examples. All of the hashing happens in the compiler, so the sketch
+// itself should be tiny
+
+// Each keyword is 40ish chars long and differs from the others only by its
+// number, e.g. "SOURce042:VOLTage:LEVel:IMMediate:AMPLitude"
+#define KEYWORD_HASH(n) COMMANDHANDLER_HASH("SOURce" #n ":VOLTage:LEVel:IMMediate:AMPLitude")
+
+#define KEYWORD_HASH_10(n) \
+  KEYWORD_HASH(n##0), KEYWORD_HASH(n##1), KEYWORD_HASH(n##2), KEYWORD_HASH(n##3), KEYWORD_HASH(n##4), \
+  KEYWORD_HASH(n##5), KEYWORD_HASH(n##6), KEYWORD_HASH(n##7), KEYWORD_HASH(n##8), KEYWORD_HASH(n##9)
+
+#define KEYWORD_HASH_100(n) \
+  KEYWORD_HASH_10(n##0), KEYWORD_HASH_10(n##1), KEYWORD_HASH_10(n##2), KEYWORD_HASH_10(n##3), KEYWORD_HASH_10(n##4), \
+  KEYWORD_HASH_10(n##5), KEYWORD_HASH_10(n##6), KEYWORD_HASH_10(n##7), KEYWORD_HASH_10(n##8), KEYWORD_HASH_10(n##9)
+
+const uint32_t keywordHashes[] PROGMEM = {
+  KEYWORD_HASH_100(0), KEYWORD_HASH_100(1), KEYWORD_HASH_100(2)
+};
+
+const size_t NUM_KEYWORDS = sizeof(keywordHashes) / sizeof(keywordHashes[0]);
+
+///////////////////////////////////////////////////////
+//             End variable declaration              //
+///////////////////////////////////////////////////////
+
+void setup() {
+  Serial.begin(9600);
+
+  // Combine the hashes so that none of them can be optimised away
+  uint32_t combined = 0;
+  for (size_t i = 0; i < NUM_KEYWORDS; i++) {
+    combined ^= pgm_read_dword(&keywordHashes[i]);
+  }
+
+  Serial.print(F("Hashed "));
+  Serial.print(NUM_KEYWORDS);
+  Serial.print(F(" keywords at compile time. Combined hash: "));
+  Serial.println(combined, HEX);
+}
+
+void loop() {}
@@ -0,0 +1,102 @@
+// Compares the speed of finding commands in a CommandLookup whose commands
+// are stored in structs (CommandTableStructs, the default) with one whose
+// hashes, numbers of params and functions are in separate arrays
+// (CommandTableArrays), for lists of 16, 256 and 4096 commands.
+//
+// The difference comes from the processor's cache, so this runs on a host,
+// not a microcontroller. Build it with the same Arduino compatibility headers
+// as the rest of your host program, e.g.
+//
+//   g++ -O2 -std=gnu++11 -I <compat headers> -I <this library> LookupBenchmark.cpp
+//
+// For each size, the average time to find a registered command is printed,
+// from the fastest of NUM_RUNS runs so that other work on the host matters less
+
+#define EEPROM_DISABLED
+
+#include <chrono>
+#include <stdio.h>
+
+#include <CommandHandler.h>
+
+// Number of lookups to time for each list, and number of times to time them
+const long NUM_LOOKUPS = 4000000;
+const int NUM_RUNS = 5;
+
+///////////////////////////////////////////////////////
+//             End variable declaration              //
+///////////////////////////////////////////////////////
+
+void dummy(const ParameterLookup& params) {}
+
+// Keywords are hashed from their number, so that both lists hold the same ones
+uint32_t keywordHash(long i) {
+
+  char keyword[16];
+  snprintf(keyword, sizeof(keyword), "cmd%ld", i);
+
+  return CommandLookup<1>::crc32b(keyword);
+}
+
+// Register `size` commands in `lookup`, then time finding them in a random
+// order. Returns the average time per lookup in ns
+template <class Lookup>
+double benchmark(Lookup& lookup, long size) {
+
+  for (long i = 0; i < size; i++) {
+    lookup.registerCommand(keywordHash(i), 0, &dummy);
+  }
+
+  // Look them up in an order which the processor can't predict
+  static uint32_t queries[4096];
+  uint32_t random = 1;
+
+  for (long i = 0; i < size; i++) {
+    random = random * 1664525UL + 1013904223UL;
+    queries[i] = keywordHash(random % size);
+  }
+
+  double fastest = 0;
+
+  for (int run = 0; run < NUM_RUNS; run++) {
+
+    long found = 0;
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (long i = 0; i < NUM_LOOKUPS; i++) {
+      found += lookup.findCommand(queries[i % size]) >= 0;
+    }
+
+    const double ns = std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count();
+
+    if (found != NUM_LOOKUPS) printf("Error: only %ld commands found\n", found);
+
+    if (run == 0 || ns < fastest) fastest = ns;
+  }
+
+  return fastest / NUM_LOOKUPS;
+}
+
+// The lists are large, so aren't kept on the stack
+CommandLookup<16> structs16;
+CommandLookup<256> structs256;
+CommandLookup<4096> structs4096;
+CommandLookup<16, CommandTableArrays> arrays16;
+CommandLookup<256, CommandTableArrays> arrays256;
+CommandLookup<4096, CommandTableArrays> arrays4096;
+
+int main() {
+
+  printf("commands\tstructs (ns)\tarrays (ns)\n");
+
+  printf("16\t%.1f\t%.1f\n", benchmark(structs16, 16), benchmark(arrays16, 16));
+  printf("256\t%.1f\t%.1f\n", benchmark(structs256, 256), benchmark(arrays256, 256));
+  printf("4096\t%.1f\t%.1f\n", benchmark(structs4096, 4096), benchmark(arrays4096, 4096));
+
+  printf("\nsizeof: 4096 structs %lu bytes, 4096 arrays %lu bytes\n",
+    (unsigned long)sizeof(structs4096), (unsigned long)sizeof(arrays4096));
+
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <CommandHandler.h>
+#include <scpiNumber.h>
+
+// Compares the SCPI number parser in scpiNumber.h with atof() and strtod()
+//
+// Each parser converts the same list of parameters many times and the average
+// time per parameter is printed, in clock cycles
+
+// Number of times to parse the list when timing
+const int NUM_REPEATS = 200;
+
+// Parameters to parse. atof() and strtod() can't read units or special
+// values, so only plain numbers are used
+const char* const parameters[] = {
+  "1", "-25", "2.5", "0.001", "-12.75", "1.5E-3", "3.3e2", "65535"
+};
+
+const int NUM_PARAMETERS = sizeof(parameters) / sizeof(parameters[0]);
+
+// Signature of the functions being compared
+typedef float parseFunction(const char* str);
+
+///////////////////////////////////////////////////////
+//             End variable declaration              //
+///////////////////////////////////////////////////////
+
+float parseWithAtof(const char* str) {
+  return atof(str);
+}
+
+float parseWithStrtod(const char* str) {
+  return strtod(str, NULL);
+}
+
+float parseToFloat(const char* str) {
+  ScpiNumber number;
+  parseScpiNumber(str, number);
+  return number.toFloat();
+}
+
+// Parse to thousandths without any float maths
+float parseToFixed(const char* str) {
+  ScpiNumber number;
+  int32_t result = 0;
+  parseScpiNumber(str, number);
+  number.toFixed(3, result);
+  return result;
+}
+
+// Print the time taken per parameter by a parser
+void timeParser(const __FlashStringHelper* name, parseFunction* parse) {
+
+  volatile float result = 0;
+
+  unsigned long start = micros();
+
+  for (int i = 0; i < NUM_REPEATS; i++) {
+    for (int j = 0; j < NUM_PARAMETERS; j++) {
+      result = parse(parameters[j]);
+    }
+  }
+
+  unsigned long elapsed = micros() - start;
+
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print((float)elapsed * (F_CPU / 1000000) / (NUM_REPEATS * NUM_PARAMETERS));
+  Serial.println(F(" cycles per parameter"));
+}
+
+void setup() {
+
+  Serial.begin(57600);
+  Serial.println(F("Program started..."));
+
+  // Check that the parsers agree
+  int mismatches = 0;
+
+  for (int j = 0; j < NUM_PARAMETERS; j++) {
+
+    const float expected = atof(parameters[j]);
+    const float difference = parseToFloat(parameters[j]) - expected;
+
+    if (difference > 1e-6 * fabs(expected) || difference < -1e-6 * fabs(expected)) {
+      mismatches++;
+    }
+  }
+
+  Serial.print(F("Mismatches with atof: "));
+  Serial.println(mismatches);
+
+  // Time each parser
+  timeParser(F("atof"), parseWithAtof);
+  timeParser(F("strtod"), parseWithStrtod);
+  timeParser(F("parseScpiNumber to float"), parseToFloat);
+  timeParser(F("parseScpiNumber to fixed"), parseToFixed);
+}
+
+void loop() {
+}
@@ -74,18 +74,19 @@ void loop() {
 // unlimited params: the string to store
 void storeCommand(const ParameterLookup& params) {
 
-  char command[COMMAND_SIZE_MAX + 1];
+  // The stored command must fit in the EEPROM, with its null terminator
+  char command[EEPROM_SIZE_MAX];
   command[0] = '\0';
   
   // Copy first part of command
-  if (params.size() > 0) {
-    strncat(command, params[1], COMMAND_SIZE_MAX);
+  if (params.size() > 1) {
+    strncat(command, params[1], EEPROM_SIZE_MAX - 1);
   }
 
   // Copy the rest of the params, with spaces between them
   for (int i = 2; i < params.size(); i++) {
-    strncat(command, " ", COMMAND_SIZE_MAX - strlen(command));
-    strncat(command, params[i], COMMAND_SIZE_MAX - strlen(command));
+    strncat(command, " ", EEPROM_SIZE_MAX - 1 - strlen(command));
+    strncat(command, params[i], EEPROM_SIZE_MAX - 1 - strlen(command));
   }
 
   Serial.print(F("Storing string: \""));
@@ -99,7 +100,7 @@ void storeCommand(const ParameterLookup& params) {
 // 0 params
 void readCommand(const ParameterLookup& params) {
 
-  char str[COMMAND_SIZE_MAX];
+  char str[EEPROM_SIZE_MAX];
   h.getStartupCommand(str);
 
   Serial.print(F("Stored string was: \""));
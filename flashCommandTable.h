@@ -0,0 +1,176 @@
+#pragma once
+
+// This file implements a list of commands which is fixed at compile time and
+// stored in flash, so that it uses no RAM, e.g.
+//
+//     constexpr CommandEntry myCommands[] PROGMEM = {
+//       COMMAND_ENTRY("*idn?", 0, &identify),
+//       COMMAND_ENTRY("volt", 1, &setVoltage),
+//       COMMAND_ENTRY("volt?", 0, &getVoltage)
+//     };
+//
+//     FlashCommandHandler<myCommands, COMMAND_TABLE_SIZE(myCommands)> h;
+//
+// The table must be declared constexpr so that the compiler can build a
+// perfect hash of its keywords (see perfectHash.h). Commands are then found
+// with a single probe of the hash, reading the table directly from flash. If
+// the table contains the same keyword twice, compilation fails.
+//
+// The handler then uses no RAM apart from its input buffer and a few bytes of
+// state. To also allow commands to be added at runtime by `registerCommand()`,
+// give the number to reserve space for as the third template argument:
+//
+//     FlashCommandHandler<myCommands, COMMAND_TABLE_SIZE(myCommands), 4> h;
+//
+// These are stored in a CommandLookup, using RAM as usual. Commands in the
+// table can't be registered again.
+
+#include "CommandHandler.h"
+#include "perfectHash.h"
+
+// A command in a table stored in flash
+struct CommandEntry {
+	uint32_t hash; // Hash of the keyword (case insensitive)
+	int n; // Number of params this function takes
+	commandFunction* f; // Pointer to this function
+};
+
+// An entry in a table of commands, given the keyword (which must be a string
+// literal), the number of params and the function, e.g.
+// COMMAND_ENTRY("volt", 1, &setVoltage)
+#define COMMAND_ENTRY(keyword, ...) { (uint32_t)COMMANDHANDLER_HASH(keyword), __VA_ARGS__ }
+
+// Number of entries in a table of commands
+#define COMMAND_TABLE_SIZE(table) (sizeof(table) / sizeof(CommandEntry))
+
+// The keywords of a table of commands, in the form needed by PerfectHash
+template <const CommandEntry* table, size_t table_size>
+struct CommandTableKeys {
+	static constexpr size_t size = table_size;
+
+	static constexpr uint32_t hash(size_t idx) {
+		return table[idx].hash;
+	}
+};
+
+// This class matches commands against a table of `table_size` CommandEntrys in
+// flash, followed by up to `overlay_size` commands registered at runtime. It
+// has the same methods as CommandLookup, so can be used by BasicCommandHandler
+template <const CommandEntry* table, size_t table_size, size_t overlay_size = 0>
+class FlashCommandLookup
+{
+	typedef PerfectHash<CommandTableKeys<table, table_size>> TableHash;
+
+public:
+
+	// Add a new command to the overlay, calculating its hash at runtime (deprecated)
+	CommandHandlerReturn registerCommand(const char* command, int num_of_parameters,
+		commandFunction* pointer_to_function) {
+
+		uint32_t crc = CRC32_INITIAL;
+
+		while (*command) {
+			crc = crc32_update(crc, *command++);
+		}
+
+		return registerCommand(crc32_final(crc), num_of_parameters, pointer_to_function);
+	}
+
+	// Add a new command to the overlay. Returns OUT_OF_MEM if no space was
+	// reserved for it
+	CommandHandlerReturn registerCommand(long keyHash, int num_of_parameters,
+		commandFunction* pointer_to_function) {
+
+		if (findInTable(keyHash) >= 0) {
+			CONSOLE_LOG_LN(F("FlashCommandLookup::Command already in table"));
+			return CommandHandlerReturn::COMMAND_ALREADY_REGISTERED;
+		}
+
+		return _overlay.registerCommand(keyHash, num_of_parameters,
+			pointer_to_function);
+	}
+
+	// Search for the given hash, first in the table then in the overlay
+	// Returns the index of the command, or -1 if not found. Commands in the
+	// overlay are numbered after those in the table
+	int findCommand(unsigned long reqHash) const
+	{
+		const int idx = findInTable(reqHash);
+
+		if (idx >= 0) return idx;
+
+		const int overlayIdx = _overlay.findCommand(reqHash);
+
+		return overlayIdx < 0 ? -1 : table_size + overlayIdx;
+	}
+
+	// Execute the command with the given hash with the given parameter
+	// array. `foundIdx` is the index of the command if it has already been
+	// looked up, or -1 if not
+	CommandHandlerReturn callStoredCommand(const ParameterLookup& params,
+		unsigned long reqHash, int foundIdx)
+	{
+		CONSOLE_LOG(F("FlashCommandLookup::callStoredCommand with n="));
+		CONSOLE_LOG_LN(params.size());
+
+		// A string containing only whitespace has no command
+		if (params.size() == 0) {
+			CONSOLE_LOG_LN(F("Empty command"));
+			return CommandHandlerReturn::EMPTY_COMMAND_STRING;
+		}
+
+		// The table never changes, so an index in it is always valid
+		const int idx = (foundIdx >= 0 && foundIdx < (int)table_size) ?
+			foundIdx : findInTable(reqHash);
+
+		if (idx < 0) {
+			// Not in the table, so try the overlay
+			const int overlayIdx = foundIdx < 0 ? -1 : foundIdx - (int)table_size;
+
+			return _overlay.callStoredCommand(params, reqHash, overlayIdx);
+		}
+
+		CommandEntry entry;
+		memcpy_P(&entry, &table[idx], sizeof(CommandEntry));
+
+		CONSOLE_LOG(F("Recalled data: entry.n = "));
+		CONSOLE_LOG_LN(entry.n);
+
+		// Return error if wrong number of parameters
+		if (entry.n != (int)params.size() - 1 && entry.n != -1) {
+			CONSOLE_LOG(F("ERROR: Expecting "));
+			CONSOLE_LOG(entry.n);
+			CONSOLE_LOG(F(" parameters but got "));
+			CONSOLE_LOG_LN(params.size() - 1);
+
+			return CommandHandlerReturn::WRONG_NUM_OF_PARAMS;
+		}
+
+		CONSOLE_LOG_LN(F("Calling function..."));
+		entry.f(params);
+
+		return params.error();
+	}
+
+private:
+
+	// Position of the hash in the table, or -1 if it isn't there
+	static int findInTable(unsigned long reqHash) {
+
+		const int idx = TableHash::candidate(reqHash);
+
+		if (idx < 0 || pgm_read_dword(&table[idx].hash) != reqHash) return -1;
+
+		return idx;
+	}
+
+	// Commands registered at runtime
+	CommandLookup<overlay_size> _overlay;
+};
+
+// A CommandHandler whose commands are in a table in flash, with room for
+// `overlay_size` more to be registered at runtime
+template <const CommandEntry* table, size_t table_size, size_t overlay_size = 0,
+	size_t queue_size = 1, size_t buffer_size = COMMAND_SIZE_MAX>
+using FlashCommandHandler = BasicCommandHandler<
+	FlashCommandLookup<table, table_size, overlay_size>, queue_size, buffer_size>;
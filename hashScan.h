@@ -0,0 +1,142 @@
+#pragma once
+
+// This file implements a search of an array of keyword hashes for one hash,
+// comparing several hashes at once with SIMD instructions where the
+// processor has them, e.g.
+//
+//     int idx = hash_scan(hashes, n, COMMANDHANDLER_HASH("volt")); // or -1
+//
+// Four implementations are provided:
+//
+//   hash_scan_scalar()  one hash at a time, for any processor (e.g. AVR)
+//   hash_scan_sse2()    4 hashes per compare, on x86 with SSE2
+//   hash_scan_avx2()    8 hashes per compare, on x86 with AVX2
+//   hash_scan_neon()    4 hashes per compare, on ARM with NEON
+//
+// hash_scan() uses the widest one which the compiler has been told the
+// processor supports (e.g. with -mavx2), or the scalar one. To always use the
+// scalar one, set this flag before including CommandHandler.h:
+// #define COMMAND_HASH_SCAN_SCALAR
+//
+// CommandLookup with CommandTableArrays uses this to search short lists of
+// commands instead of binary searching them: see COMMAND_HASH_SCAN_SIZE.
+
+#include <Arduino.h>
+
+#if !defined(COMMAND_HASH_SCAN_SCALAR)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define COMMAND_HASH_SCAN_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define COMMAND_HASH_SCAN_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define COMMAND_HASH_SCAN_NEON
+#endif
+#endif
+
+// Number of hashes compared at once by hash_scan()
+#if defined(COMMAND_HASH_SCAN_AVX2)
+#define HASH_SCAN_LANES 8
+#elif defined(COMMAND_HASH_SCAN_SSE2) || defined(COMMAND_HASH_SCAN_NEON)
+#define HASH_SCAN_LANES 4
+#else
+#define HASH_SCAN_LANES 1
+#endif
+
+// Lists of at most this many commands are scanned by CommandTableArrays
+// instead of being binary searched
+#ifndef COMMAND_HASH_SCAN_SIZE
+#define COMMAND_HASH_SCAN_SIZE (8 * HASH_SCAN_LANES)
+#endif
+
+// Position of `hash` in the `n` hashes at `hashes`, or -1 if it isn't there
+inline int hash_scan_scalar(const uint32_t* hashes, size_t n, uint32_t hash) {
+
+  for (size_t i = 0; i < n; i++) {
+    if (hashes[i] == hash) return i;
+  }
+
+  return -1;
+}
+
+#ifdef COMMAND_HASH_SCAN_SSE2
+inline int hash_scan_sse2(const uint32_t* hashes, size_t n, uint32_t hash) {
+
+  const __m128i key = _mm_set1_epi32(hash);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+
+    const __m128i block = _mm_loadu_si128((const __m128i*)(hashes + i));
+
+    // One bit for each of the 4 hashes which matched
+    const int matches = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, key)));
+
+    if (matches) return i + __builtin_ctz(matches);
+  }
+
+  const int rest = hash_scan_scalar(hashes + i, n - i, hash);
+
+  return rest < 0 ? -1 : i + rest;
+}
+#endif
+
+#ifdef COMMAND_HASH_SCAN_AVX2
+inline int hash_scan_avx2(const uint32_t* hashes, size_t n, uint32_t hash) {
+
+  const __m256i key = _mm256_set1_epi32(hash);
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+
+    const __m256i block = _mm256_loadu_si256((const __m256i*)(hashes + i));
+
+    // One bit for each of the 8 hashes which matched
+    const int matches = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, key)));
+
+    if (matches) return i + __builtin_ctz(matches);
+  }
+
+  const int rest = hash_scan_scalar(hashes + i, n - i, hash);
+
+  return rest < 0 ? -1 : i + rest;
+}
+#endif
+
+#ifdef COMMAND_HASH_SCAN_NEON
+inline int hash_scan_neon(const uint32_t* hashes, size_t n, uint32_t hash) {
+
+  const uint32x4_t key = vdupq_n_u32(hash);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+
+    const uint32x4_t equal = vceqq_u32(vld1q_u32(hashes + i), key);
+
+    // Narrow each 32 bit result to 16 bits, so that all 4 fit in a uint64_t
+    const uint64_t matches = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(equal)), 0);
+
+    if (matches) return i + __builtin_ctzll(matches) / 16;
+  }
+
+  const int rest = hash_scan_scalar(hashes + i, n - i, hash);
+
+  return rest < 0 ? -1 : i + rest;
+}
+#endif
+
+// Position of `hash` in the `n` hashes at `hashes`, or -1 if it isn't there,
+// using the selected implementation
+inline int hash_scan(const uint32_t* hashes, size_t n, uint32_t hash) {
+#if defined(COMMAND_HASH_SCAN_AVX2)
+  return hash_scan_avx2(hashes, n, hash);
+#elif defined(COMMAND_HASH_SCAN_SSE2)
+  return hash_scan_sse2(hashes, n, hash);
+#elif defined(COMMAND_HASH_SCAN_NEON)
+  return hash_scan_neon(hashes, n, hash);
+#else
+  return hash_scan_scalar(hashes, n, hash);
+#endif
+}
@@ -0,0 +1,476 @@
+#pragma once
+
+// This file implements a host only (e.g. Linux) way of executing commands in
+// parallel on a pool of threads, for programs which serve many instruments
+// at once, e.g.
+//
+//     CommandLookup<20> commands;
+//     commands.registerCommand(COMMANDHANDLER_HASH("volt"), 1, &setVoltage);
+//
+//     HostDispatcher<CommandLookup<20>> dispatcher(commands);
+//     dispatcher.setGroup(COMMANDHANDLER_HASH("volt"), 1);
+//
+//     dispatcher.submit("volt 1.5", &voltageSet, instrument);
+//
+// Commands can be submitted from any number of threads. They are passed to
+// the workers through a lock free queue, so submitting never waits for a
+// command to run. Each command is copied into a job taken from a free list,
+// under a lock which is only held to unlink it, so jobs are only allocated
+// while more commands are outstanding than ever before. One worker at a time
+// moves the submitted commands on to the workers' own queues, from which each
+// worker takes its next command, or steals one from another worker if its own
+// queue is empty. Idle workers sleep until a command is submitted or becomes
+// ready to run.
+//
+// Commands in the same ordering group are executed one at a time, in the
+// order that they were submitted. Commands in different groups, or in no
+// group, run in parallel. A command's group is given when it is submitted or,
+// if not, by `setGroup()` for its keyword.
+//
+// When a command has been executed, the completionFunction passed with it is
+// called on the worker's thread. The command functions must therefore be safe
+// to call from several threads at once, unless they share a group.
+//
+// The lookup is shared by all the workers and must not be changed while the
+// dispatcher is running.
+
+#if defined(ARDUINO)
+#error "hostDispatcher.h uses threads, so can only be used in host builds"
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CommandHandler.h"
+
+// The result of a command executed by a HostDispatcher
+struct CommandCompletion {
+  const char* command; // The command, as submitted
+  CommandHandlerReturn result; // Result of executing it
+  void* context; // As passed to `submit()`
+};
+
+// Template for the functions called once a command has been executed
+typedef void completionFunction(const CommandCompletion& completion);
+
+template <class Lookup>
+class HostDispatcher {
+
+public:
+
+  // Group of commands which may run in any order
+  static const int NO_GROUP = -1;
+
+  // Start `num_threads` workers which execute the commands in `lookup`
+  explicit HostDispatcher(Lookup& lookup,
+    unsigned int num_threads = std::thread::hardware_concurrency()) :
+    _lookup(lookup), _inHead(&_stub), _inTail(&_stub), _freeJobs(NULL),
+    _queues(num_threads ? num_threads : 1), _wakeups(0),
+    _outstanding(0), _stopping(false)
+  {
+    _stub.next.store(NULL, std::memory_order_relaxed);
+    _draining.clear();
+
+    for (unsigned int i = 0; i < _queues.size(); i++) {
+      _threads.push_back(std::thread(&HostDispatcher::work, this, i));
+    }
+  }
+
+  // Finish all submitted commands, then stop the workers
+  ~HostDispatcher() {
+
+    wait();
+
+    {
+      std::lock_guard<std::mutex> lock(_sleepMutex);
+      _stopping = true;
+    }
+    _wake.notify_all();
+
+    for (size_t i = 0; i < _threads.size(); i++) _threads[i].join();
+
+    while (_freeJobs) {
+      Job* job = _freeJobs;
+      _freeJobs = job->groupNext;
+      delete job;
+    }
+  }
+
+  // Put commands with the keyword `hash` in ordering group `group` (0 or
+  // more), unless another group is given when they are submitted. Call this
+  // before submitting any commands
+  void setGroup(uint32_t hash, int group) { _groups[hash] = group; }
+
+  // Submit a command to be executed, in the group given by `setGroup()` for
+  // its keyword. See below
+  CommandHandlerReturn submit(const char* command,
+    completionFunction* done = NULL, void* context = NULL) {
+    return submit(command, keywordGroup(keywordHash(command)), done, context);
+  }
+
+  // Submit a command to be executed in ordering group `group`, or NO_GROUP.
+  // This may be called from any thread. `done` is called with `context` once
+  // the command has been executed. Returns COMMAND_TOO_LONG, without calling
+  // `done`, if the command is not shorter than COMMAND_SIZE_MAX
+  CommandHandlerReturn submit(const char* command, int group,
+    completionFunction* done = NULL, void* context = NULL) {
+
+    const size_t length = strlen(command);
+
+    if (length >= COMMAND_SIZE_MAX) return CommandHandlerReturn::COMMAND_TOO_LONG;
+
+    Job* job = allocate();
+    memcpy(job->command, command, length + 1);
+    job->hash = keywordHash(command);
+    job->group = group;
+    job->done = done;
+    job->context = context;
+    job->groupNext = NULL;
+
+    _outstanding.fetch_add(1, std::memory_order_relaxed);
+
+    push(job);
+    makeAvailable();
+
+    return CommandHandlerReturn::NO_ERROR;
+  }
+
+  // Wait until every command submitted so far has been executed
+  void wait() {
+    std::unique_lock<std::mutex> lock(_idleMutex);
+    _idle.wait(lock, [this] { return _outstanding.load() == 0; });
+  }
+
+  // Number of worker threads
+  size_t threads() const { return _threads.size(); }
+
+private:
+
+  // A submitted command
+  struct Job {
+    std::atomic<Job*> next; // Next job in the submission queue
+    Job* groupNext; // Next job waiting for the same group, or on the free list
+    char command[COMMAND_SIZE_MAX];
+    uint32_t hash; // Hash of the keyword
+    int group;
+    completionFunction* done;
+    void* context;
+  };
+
+  // Jobs of one group waiting for the running one to finish
+  struct Strand {
+    Strand() : head(NULL), tail(NULL), running(false) {}
+
+    Job* head;
+    Job* tail;
+    bool running;
+  };
+
+  // A worker's queue of jobs which are ready to run. The worker takes jobs
+  // from the back and others steal them from the front
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<Job*> jobs;
+  };
+
+  // Hash of the keyword of a command, as calculated by CommandHandler
+  static uint32_t keywordHash(const char* command) {
+
+    while (ParameterTable::isDelimiter(*command)) command++;
+
+    uint32_t crc = CRC32_INITIAL;
+
+    while (*command && !ParameterTable::isDelimiter(*command)) {
+      crc = crc32_update(crc, *command++);
+    }
+
+    return crc32_final(crc);
+  }
+
+  // Group given to a keyword by `setGroup()`, or NO_GROUP
+  int keywordGroup(uint32_t hash) const {
+    const typename std::map<uint32_t, int>::const_iterator it = _groups.find(hash);
+    return it == _groups.end() ? NO_GROUP : it->second;
+  }
+
+  // Take a job from the free list, or allocate one if it's empty
+  Job* allocate() {
+
+    {
+      std::lock_guard<std::mutex> lock(_freeMutex);
+
+      if (_freeJobs) {
+        Job* job = _freeJobs;
+        _freeJobs = job->groupNext;
+        return job;
+      }
+    }
+
+    return new Job;
+  }
+
+  // Put a finished job on the free list, to be reused by `submit()`
+  void recycle(Job* job) {
+    std::lock_guard<std::mutex> lock(_freeMutex);
+    job->groupNext = _freeJobs;
+    _freeJobs = job;
+  }
+
+  // Add a job to the submission queue. This is the producer side of a lock
+  // free multiple producer, single consumer queue (Vyukov's intrusive queue)
+  void push(Job* job) {
+    job->next.store(NULL, std::memory_order_relaxed);
+    Job* const prev = _inHead.exchange(job, std::memory_order_acq_rel);
+    prev->next.store(job, std::memory_order_release);
+  }
+
+  // Remove the oldest job from the submission queue, or return NULL if there
+  // isn't one ready. Only one thread may call this at a time
+  Job* pop() {
+
+    Job* tail = _inTail;
+    Job* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &_stub) {
+      if (!next) return NULL;
+
+      _inTail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next) {
+      _inTail = next;
+      return tail;
+    }
+
+    // `tail` is the last job, unless another is being pushed after it
+    if (tail != _inHead.load(std::memory_order_acquire)) return NULL;
+
+    // Put the stub back at the end so that `tail` can be removed
+    push(&_stub);
+
+    next = tail->next.load(std::memory_order_acquire);
+
+    if (next) {
+      _inTail = next;
+      return tail;
+    }
+
+    return NULL;
+  }
+
+  // Move submitted jobs to the worker queues, keeping back any whose group is
+  // already running. Only one worker does this at a time, and it wakes others
+  // to steal all but one of the jobs which it moves to its own queue
+  void drain(unsigned int self) {
+
+    if (_draining.test_and_set(std::memory_order_acquire)) return;
+
+    unsigned int moved = 0;
+
+    while (Job* job = pop()) {
+
+      if (job->group == NO_GROUP) {
+        ready(job, self);
+        moved++;
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(_strandsMutex);
+      Strand& strand = _strands[job->group];
+
+      if (strand.running) {
+        if (strand.tail) strand.tail->groupNext = job;
+        else strand.head = job;
+        strand.tail = job;
+      }
+      else {
+        strand.running = true;
+        lock.unlock();
+
+        ready(job, self);
+        moved++;
+      }
+    }
+
+    _draining.clear(std::memory_order_release);
+
+    for (; moved > 1; moved--) makeAvailable();
+  }
+
+  // A job of this group has finished, so start the next one
+  void releaseGroup(int group, unsigned int self) {
+
+    Job* next;
+
+    {
+      std::lock_guard<std::mutex> lock(_strandsMutex);
+      Strand& strand = _strands[group];
+
+      next = strand.head;
+
+      if (next) {
+        strand.head = next->groupNext;
+        if (!strand.head) strand.tail = NULL;
+      }
+      else {
+        strand.running = false;
+      }
+    }
+
+    if (next) {
+      ready(next, self);
+      makeAvailable();
+    }
+  }
+
+  // Add a job which can run now to a worker's queue
+  void ready(Job* job, unsigned int self) {
+    WorkerQueue& queue = _queues[self];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.jobs.push_back(job);
+  }
+
+  // A job has been submitted or can now run, so wake a worker for it
+  void makeAvailable() {
+
+    {
+      std::lock_guard<std::mutex> lock(_sleepMutex);
+      _wakeups.fetch_add(1, std::memory_order_release);
+    }
+    _wake.notify_one();
+  }
+
+  // Find a job to run: the newest in this worker's queue, otherwise a newly
+  // submitted one, otherwise the oldest in another worker's queue
+  Job* take(unsigned int self) {
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+
+      {
+        WorkerQueue& queue = _queues[self];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (!queue.jobs.empty()) {
+          Job* job = queue.jobs.back();
+          queue.jobs.pop_back();
+          return job;
+        }
+      }
+
+      if (attempt == 0) drain(self);
+    }
+
+    for (size_t i = 1; i < _queues.size(); i++) {
+
+      WorkerQueue& queue = _queues[(self + i) % _queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+
+      if (!queue.jobs.empty()) {
+        Job* job = queue.jobs.front();
+        queue.jobs.pop_front();
+        return job;
+      }
+    }
+
+    return NULL;
+  }
+
+  // Execute a job and report its completion
+  void run(Job* job, unsigned int self) {
+
+    BasicParameterLookup<COMMAND_SIZE_MAX> params(job->command);
+
+    CommandCompletion completion;
+    completion.command = job->command;
+    completion.result = _lookup.callStoredCommand(params, job->hash, -1);
+    completion.context = job->context;
+
+    if (job->done) job->done(completion);
+
+    if (job->group != NO_GROUP) releaseGroup(job->group, self);
+
+    recycle(job);
+
+    if (_outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      std::lock_guard<std::mutex> lock(_idleMutex);
+      _idle.notify_all();
+    }
+  }
+
+  // The loop run by each worker thread
+  void work(unsigned int self) {
+
+    while (true) {
+
+      // Note the wakeups before looking for a job, so that one made available
+      // while looking stops this worker from going to sleep
+      const unsigned long seen = _wakeups.load(std::memory_order_acquire);
+
+      Job* job = take(self);
+
+      if (job) {
+        run(job, self);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(_sleepMutex);
+
+      if (_stopping) return;
+
+      _wake.wait(lock, [this, seen] {
+        return _stopping || _wakeups.load(std::memory_order_relaxed) != seen;
+      });
+    }
+  }
+
+  // Commands to execute
+  Lookup& _lookup;
+
+  // Groups given by `setGroup()`, by keyword hash
+  std::map<uint32_t, int> _groups;
+
+  // Submission queue. Producers add to `_inHead` and the draining worker
+  // removes from `_inTail`
+  Job _stub;
+  std::atomic<Job*> _inHead;
+  Job* _inTail;
+  std::atomic_flag _draining;
+
+  // Finished jobs, linked by `groupNext`, for `submit()` to reuse
+  Job* _freeJobs;
+  std::mutex _freeMutex;
+
+  // Groups with a job running, and the jobs waiting for them
+  std::map<int, Strand> _strands;
+  std::mutex _strandsMutex;
+
+  // Each worker's jobs which are ready to run
+  std::vector<WorkerQueue> _queues;
+  std::vector<std::thread> _threads;
+
+  // Number of times a worker has been woken for a job. Workers sleep until
+  // this changes
+  std::atomic<unsigned long> _wakeups;
+
+  // Number of jobs submitted but not yet finished
+  std::atomic<long> _outstanding;
+
+  // For idle workers to sleep on
+  std::mutex _sleepMutex;
+  std::condition_variable _wake;
+  bool _stopping;
+
+  // For `wait()`
+  std::mutex _idleMutex;
+  std::condition_variable _idle;
+};
+
+template <class Lookup>
+const int HostDispatcher<Lookup>::NO_GROUP;
@@ -0,0 +1,261 @@
+#pragma once
+
+// This file implements conversions of parameter strings to numbers, e.g.
+//
+//     float volts;
+//     if (!parseParam(params[1], volts)) { ... }
+//
+// They don't use the C library (atoi, atof, strtod), so its large float
+// routines are left out of flash. Each returns false if the whole string is
+// not a valid value of the right type, in which case `result` is unchanged.
+//
+// Integers are an optional sign followed by decimal digits, and fail if they
+// don't fit the type. Floats may also have a decimal point and an exponent,
+// e.g. "-1.5e-3". Only the first 9 significant digits of a float are used.
+// Booleans are "0", "1", "ON" or "OFF", in any case, as in SCPI.
+
+#include <limits.h>
+
+// Skip an optional sign. Returns true if it was a minus
+inline bool parseSign(const char*& str) {
+
+  if (*str == '-') {
+    str++;
+    return true;
+  }
+
+  if (*str == '+') str++;
+
+  return false;
+}
+
+inline bool parseIsDigit(const char c) { return c >= '0' && c <= '9'; }
+
+// Parse one or more decimal digits, failing if their value is more than `max`
+inline bool parseDigits(const char*& str, unsigned long max, unsigned long& result) {
+
+  if (!parseIsDigit(*str)) return false;
+
+  unsigned long value = 0;
+
+  while (parseIsDigit(*str)) {
+
+    const unsigned char digit = *str++ - '0';
+
+    if (digit > max || value > (max - digit) / 10) return false;
+
+    value = value * 10 + digit;
+  }
+
+  result = value;
+  return true;
+}
+
+// Parse an integer between -`negativeMax` and `positiveMax`
+inline bool parseInteger(const char* str, unsigned long positiveMax,
+  unsigned long negativeMax, bool& negative, unsigned long& magnitude) {
+
+  if (!str) return false;
+
+  negative = parseSign(str);
+
+  if (!parseDigits(str, negative ? negativeMax : positiveMax, magnitude)) return false;
+
+  return *str == '\0';
+}
+
+inline bool parseParam(const char* str, long& result) {
+
+  bool negative;
+  unsigned long magnitude;
+
+  if (!parseInteger(str, LONG_MAX, (unsigned long)LONG_MAX + 1, negative, magnitude))
+    return false;
+
+  result = negative ? -(long)(magnitude - 1) - 1 : (long)magnitude;
+  return true;
+}
+
+inline bool parseParam(const char* str, int& result) {
+
+  bool negative;
+  unsigned long magnitude;
+
+  if (!parseInteger(str, INT_MAX, (unsigned long)INT_MAX + 1, negative, magnitude))
+    return false;
+
+  result = negative ? -(int)(magnitude - 1) - 1 : (int)magnitude;
+  return true;
+}
+
+inline bool parseParam(const char* str, unsigned long& result) {
+
+  bool negative;
+  unsigned long magnitude;
+
+  if (!parseInteger(str, ULONG_MAX, 0, negative, magnitude)) return false;
+
+  result = magnitude;
+  return true;
+}
+
+inline bool parseParam(const char* str, unsigned int& result) {
+
+  bool negative;
+  unsigned long magnitude;
+
+  if (!parseInteger(str, UINT_MAX, 0, negative, magnitude)) return false;
+
+  result = magnitude;
+  return true;
+}
+
+// Calculate 10^e by repeated squaring
+template <class T>
+T parsePowerOfTen(unsigned int e) {
+
+  T result = 1;
+  T power = 10;
+
+  for (; e; e >>= 1) {
+    if (e & 1) result *= power;
+    power *= power;
+  }
+
+  return result;
+}
+
+// Calculate mantissa * 10^exponent. 10^exponent can overflow even if the
+// result doesn't, e.g. 10^46 for "123456789e-46" as a float, so exponents of
+// more than 30 are applied in two halves
+template <class T>
+T parseScale(uint32_t mantissa, int exponent) {
+
+  if (mantissa == 0) return 0;
+
+  const unsigned int magnitude = exponent < 0 ? -exponent : exponent;
+  const unsigned int first = magnitude > 30 ? magnitude / 2 : magnitude;
+
+  const T scale = parsePowerOfTen<T>(first);
+  const T rest = parsePowerOfTen<T>(magnitude - first);
+
+  return exponent < 0 ? mantissa / scale / rest : mantissa * scale * rest;
+}
+
+// Parse decimal digits with an optional decimal point, keeping the first 9
+// significant digits in `mantissa` and adjusting `exponent` for the rest.
+// Fails if there are no digits
+inline bool parseMantissa(const char*& str, uint32_t& mantissa, int& exponent) {
+
+  mantissa = 0;
+  exponent = 0;
+  bool anyDigits = false;
+
+  while (parseIsDigit(*str)) {
+    if (mantissa < 100000000UL)
+      mantissa = mantissa * 10 + (*str - '0');
+    else
+      exponent++;
+
+    anyDigits = true;
+    str++;
+  }
+
+  if (*str == '.') {
+    str++;
+
+    while (parseIsDigit(*str)) {
+      if (mantissa < 100000000UL) {
+        mantissa = mantissa * 10 + (*str - '0');
+        exponent--;
+      }
+
+      anyDigits = true;
+      str++;
+    }
+  }
+
+  return anyDigits;
+}
+
+// Parse a float or double. On AVR these are the same size
+template <class T>
+bool parseFloat(const char* str, T& result) {
+
+  if (!str) return false;
+
+  const bool negative = parseSign(str);
+
+  uint32_t mantissa;
+  int exponent;
+
+  if (!parseMantissa(str, mantissa, exponent)) return false;
+
+  if (*str == 'e' || *str == 'E') {
+    str++;
+
+    const bool negativeExponent = parseSign(str);
+    unsigned long exponentValue;
+
+    if (!parseDigits(str, 9999, exponentValue)) return false;
+
+    exponent += negativeExponent ? -(int)exponentValue : (int)exponentValue;
+  }
+
+  if (*str != '\0') return false;
+
+  const T value = parseScale<T>(mantissa, exponent);
+
+  result = negative ? -value : value;
+  return true;
+}
+
+inline bool parseParam(const char* str, float& result) {
+  return parseFloat(str, result);
+}
+
+inline bool parseParam(const char* str, double& result) {
+  return parseFloat(str, result);
+}
+
+// Compare a string to an upper case word, ignoring case
+inline bool parseMatchWord(const char* str, const char* word) {
+
+  while (*word) {
+
+    const char c = (*str >= 'a' && *str <= 'z') ? *str - ('a' - 'A') : *str;
+
+    if (c != *word) return false;
+
+    str++;
+    word++;
+  }
+
+  return *str == '\0';
+}
+
+inline bool parseParam(const char* str, bool& result) {
+
+  if (!str) return false;
+
+  if (parseMatchWord(str, "1") || parseMatchWord(str, "ON")) {
+    result = true;
+    return true;
+  }
+
+  if (parseMatchWord(str, "0") || parseMatchWord(str, "OFF")) {
+    result = false;
+    return true;
+  }
+
+  return false;
+}
+
+// Strings are passed through unchanged
+inline bool parseParam(const char* str, const char*& result) {
+
+  if (!str) return false;
+
+  result = str;
+  return true;
+}
@@ -0,0 +1,436 @@
+#pragma once
+
+// This file implements a perfect hash of a list of keyword hashes which is
+// known at compile time, e.g.
+//
+//     typedef HashList<
+//         COMMANDHANDLER_HASH("*idn?"),
+//         COMMANDHANDLER_HASH("volt"),
+//         COMMANDHANDLER_HASH("volt?")
+//     > myKeywords;
+//
+//     int idx = PerfectHash<myKeywords>::find(hash); // 0, 1, 2 or -1
+//
+// `find()` returns the position of a hash in the list, or -1 if it isn't
+// there, in constant time no matter how long the list is. All the tables it
+// uses are calculated by the compiler and stored in flash, so no RAM is used.
+//
+// If the list contains the same keyword twice, compilation fails with a
+// static_assert.
+//
+// Implementation --------------
+//
+// This is a two level (FKS) perfect hash. Each keyword is first mixed and
+// assigned to one of `numBuckets` buckets. Each bucket of n keywords then has
+// its own range of slots, at least n^2 long, and a seed. The seed is chosen by
+// the compiler so that mixing with it puts every keyword in the bucket in a
+// different slot. The slot holds the position of the keyword in the list.
+//
+// Only C++11 constexpr is used, so everything is done by recursion. Sums over
+// the list are split in half at each level so that long lists don't hit the
+// compiler's recursion limit.
+
+// A list of indices 0, 1, ... N-1 as template parameters (std::index_sequence
+// is not available before C++14)
+template <size_t... I>
+struct IndexSequence {};
+
+template <class A, class B>
+struct ConcatIndexSequence;
+
+template <size_t... A, size_t... B>
+struct ConcatIndexSequence<IndexSequence<A...>, IndexSequence<B...>> {
+  typedef IndexSequence<A..., (sizeof...(A) + B)...> type;
+};
+
+template <size_t N>
+struct MakeIndexSequence {
+  typedef typename ConcatIndexSequence<
+    typename MakeIndexSequence<N / 2>::type,
+    typename MakeIndexSequence<N - N / 2>::type
+  >::type type;
+};
+
+template <>
+struct MakeIndexSequence<0> { typedef IndexSequence<> type; };
+
+template <>
+struct MakeIndexSequence<1> { typedef IndexSequence<0> type; };
+
+// A list of keyword hashes to be passed to PerfectHash
+template <uint32_t... hashes>
+struct HashList {
+  static constexpr size_t size = sizeof...(hashes);
+
+  static constexpr uint32_t hash(size_t idx) {
+    return values[idx];
+  }
+
+  static constexpr uint32_t values[sizeof...(hashes) ? sizeof...(hashes) : 1] = { hashes... };
+};
+
+template <uint32_t... hashes>
+constexpr uint32_t HashList<hashes...>::values[];
+
+// Mix the bits of a hash with a seed. This must give the same results at
+// compile time and at runtime
+constexpr uint32_t perfect_hash_shift_xor(const uint32_t x) {
+  return x ^ (x >> 15);
+}
+
+constexpr uint32_t perfect_hash_mix(const uint32_t hash, const uint32_t seed) {
+  return perfect_hash_shift_xor(
+    (uint32_t)(perfect_hash_shift_xor(hash ^ (uint32_t)(seed * (uint32_t)0x9E3779B9)) *
+      (uint32_t)0x2C1B3C6D));
+}
+
+// Smallest power of two >= n
+constexpr size_t perfect_hash_pow2(const size_t n, const size_t p = 1) {
+  return p >= n ? p : perfect_hash_pow2(n, 2 * p);
+}
+
+// Number of slots for a bucket of n keywords
+constexpr size_t perfect_hash_bucket_slots(const size_t n) {
+  return n == 0 ? 0 : perfect_hash_pow2(n * n);
+}
+
+// Sum of arr[lo, hi)
+constexpr size_t perfect_hash_sum(const size_t* arr, const size_t lo, const size_t hi) {
+  return hi - lo == 0 ? 0 :
+    hi - lo == 1 ? arr[lo] :
+    perfect_hash_sum(arr, lo, (lo + hi) / 2) + perfect_hash_sum(arr, (lo + hi) / 2, hi);
+}
+
+// Number of entries in arr[lo, hi) equal to v
+constexpr size_t perfect_hash_count(const size_t* arr, const size_t v, const size_t lo, const size_t hi) {
+  return hi - lo == 0 ? 0 :
+    hi - lo == 1 ? (arr[lo] == v ? 1 : 0) :
+    perfect_hash_count(arr, v, lo, (lo + hi) / 2) + perfect_hash_count(arr, v, (lo + hi) / 2, hi);
+}
+
+// Position of an entry in arr[lo, hi) equal to v, or -1 if there isn't one
+constexpr size_t perfect_hash_find(const size_t* arr, const size_t v, const size_t lo, const size_t hi) {
+  return hi - lo == 0 ? size_t(-1) :
+    hi - lo == 1 ? (arr[lo] == v ? lo : size_t(-1)) :
+    perfect_hash_find(arr, v, lo, (lo + hi) / 2) != size_t(-1) ?
+      perfect_hash_find(arr, v, lo, (lo + hi) / 2) :
+      perfect_hash_find(arr, v, (lo + hi) / 2, hi);
+}
+
+// The compile time calculations for a list of keywords are done in stages.
+// Each stage stores its results in a constexpr array for the next one to use,
+// so nothing is calculated twice. `Keys` must provide `size` and a constexpr
+// `hash(idx)`, like HashList.
+
+// Sizes and mixing functions
+template <class Keys>
+struct PerfectHashParams {
+
+  static constexpr size_t numKeys = Keys::size;
+  static constexpr size_t numBuckets = perfect_hash_pow2(numKeys);
+
+  // Seeds are a byte: this value means no seed could be found
+  static constexpr uint8_t SEED_FAILED = 0xFF;
+
+  static constexpr size_t bucketOf(const uint32_t hash) {
+    return perfect_hash_mix(hash, 0) & (numBuckets - 1);
+  }
+
+  // Slot within its bucket of a hash, given the bucket's seed and size
+  static constexpr size_t slotOf(const uint32_t hash, const uint8_t seed, const size_t slots) {
+    return perfect_hash_mix(hash, seed + 1) & (slots - 1);
+  }
+
+  typedef typename MakeIndexSequence<numKeys>::type KeyIndices;
+  typedef typename MakeIndexSequence<numBuckets>::type BucketIndices;
+};
+
+// Stage 1: the bucket of each key
+template <class Keys, class I = typename PerfectHashParams<Keys>::KeyIndices>
+struct PerfectHashKeyBuckets;
+
+template <class Keys, size_t... K>
+struct PerfectHashKeyBuckets<Keys, IndexSequence<K...>> {
+  static constexpr size_t bucket[sizeof...(K) + 1] = {
+    PerfectHashParams<Keys>::bucketOf(Keys::hash(K))..., 0 };
+};
+
+template <class Keys, size_t... K>
+constexpr size_t PerfectHashKeyBuckets<Keys, IndexSequence<K...>>::bucket[];
+
+// Stage 2: the number of keys and slots in each bucket
+template <class Keys, class I = typename PerfectHashParams<Keys>::BucketIndices>
+struct PerfectHashBucketSizes;
+
+template <class Keys, size_t... B>
+struct PerfectHashBucketSizes<Keys, IndexSequence<B...>> {
+  typedef PerfectHashKeyBuckets<Keys> Prev;
+  static constexpr size_t n = Keys::size;
+
+  static constexpr size_t count[sizeof...(B) + 1] = {
+    perfect_hash_count(Prev::bucket, B, 0, n)..., 0 };
+  static constexpr size_t slots[sizeof...(B) + 1] = {
+    perfect_hash_bucket_slots(perfect_hash_count(Prev::bucket, B, 0, n))..., 0 };
+};
+
+template <class Keys, size_t... B>
+constexpr size_t PerfectHashBucketSizes<Keys, IndexSequence<B...>>::count[];
+
+template <class Keys, size_t... B>
+constexpr size_t PerfectHashBucketSizes<Keys, IndexSequence<B...>>::slots[];
+
+// Stage 3: the position of each bucket's keys in the sorted list of keys and
+// of its slots in the table of slots
+template <class Keys, class I = typename PerfectHashParams<Keys>::BucketIndices>
+struct PerfectHashBucketOffsets;
+
+template <class Keys, size_t... B>
+struct PerfectHashBucketOffsets<Keys, IndexSequence<B...>> {
+  typedef PerfectHashBucketSizes<Keys> Prev;
+
+  static constexpr size_t numSlots = perfect_hash_sum(Prev::slots, 0, sizeof...(B));
+
+  static constexpr size_t first[sizeof...(B) + 1] = {
+    perfect_hash_sum(Prev::count, 0, B)..., Keys::size };
+  static constexpr size_t offset[sizeof...(B) + 1] = {
+    perfect_hash_sum(Prev::slots, 0, B)..., numSlots };
+};
+
+template <class Keys, size_t... B>
+constexpr size_t PerfectHashBucketOffsets<Keys, IndexSequence<B...>>::first[];
+
+template <class Keys, size_t... B>
+constexpr size_t PerfectHashBucketOffsets<Keys, IndexSequence<B...>>::offset[];
+
+// Stage 4: the position of each key when sorted by bucket
+template <class Keys, class I = typename PerfectHashParams<Keys>::KeyIndices>
+struct PerfectHashKeyPositions;
+
+template <class Keys, size_t... K>
+struct PerfectHashKeyPositions<Keys, IndexSequence<K...>> {
+  typedef PerfectHashKeyBuckets<Keys> Buckets;
+  typedef PerfectHashBucketOffsets<Keys> Offsets;
+
+  static constexpr size_t pos[sizeof...(K) + 1] = {
+    (Offsets::first[Buckets::bucket[K]] +
+      perfect_hash_count(Buckets::bucket, Buckets::bucket[K], 0, K))..., 0 };
+};
+
+template <class Keys, size_t... K>
+constexpr size_t PerfectHashKeyPositions<Keys, IndexSequence<K...>>::pos[];
+
+// Stage 5: the keys sorted by bucket
+template <class Keys, class I = typename PerfectHashParams<Keys>::KeyIndices>
+struct PerfectHashSortedKeys;
+
+template <class Keys, size_t... K>
+struct PerfectHashSortedKeys<Keys, IndexSequence<K...>> {
+  static constexpr size_t key[sizeof...(K) + 1] = {
+    perfect_hash_find(PerfectHashKeyPositions<Keys>::pos, K, 0, sizeof...(K))..., 0 };
+};
+
+template <class Keys, size_t... K>
+constexpr size_t PerfectHashSortedKeys<Keys, IndexSequence<K...>>::key[];
+
+// Functions for examining the keys in one bucket
+template <class Keys>
+struct PerfectHashBucket {
+  typedef PerfectHashParams<Keys> Params;
+  typedef PerfectHashBucketSizes<Keys> Sizes;
+  typedef PerfectHashBucketOffsets<Keys> Offsets;
+  typedef PerfectHashSortedKeys<Keys> Sorted;
+
+  // Hash of the key at sorted position `p`
+  static constexpr uint32_t hashAt(const size_t p) {
+    return Keys::hash(Sorted::key[p]);
+  }
+
+  // True if the key at sorted position `p` clashes with any in [lo, hi),
+  // either by having the same hash or, if `checkSlots`, by landing in the same
+  // slot of bucket `b` using `seed`
+  static constexpr bool clashes(const size_t b, const uint8_t seed, const bool checkSlots,
+    const size_t p, const size_t lo, const size_t hi) {
+    return hi - lo == 0 ? false :
+      hi - lo == 1 ? (checkSlots ?
+        Params::slotOf(hashAt(p), seed, Sizes::slots[b]) == Params::slotOf(hashAt(lo), seed, Sizes::slots[b]) :
+        hashAt(p) == hashAt(lo)) :
+      clashes(b, seed, checkSlots, p, lo, (lo + hi) / 2) ||
+        clashes(b, seed, checkSlots, p, (lo + hi) / 2, hi);
+  }
+
+  // True if any key at sorted positions [lo, hi) clashes with a later key in
+  // bucket `b`
+  static constexpr bool anyClash(const size_t b, const uint8_t seed, const bool checkSlots,
+    const size_t lo, const size_t hi) {
+    return hi - lo == 0 ? false :
+      hi - lo == 1 ? clashes(b, seed, checkSlots, lo, lo + 1, Offsets::first[b + 1]) :
+      anyClash(b, seed, checkSlots, lo, (lo + hi) / 2) ||
+        anyClash(b, seed, checkSlots, (lo + hi) / 2, hi);
+  }
+
+  static constexpr bool hasDuplicates(const size_t b) {
+    return anyClash(b, 0, false, Offsets::first[b], Offsets::first[b + 1]);
+  }
+
+  // Find a seed which separates the keys in bucket `b`. Duplicates can never
+  // be separated, but they are reported separately so give up on them
+  static constexpr uint8_t findSeed(const size_t b, const uint8_t seed = 0) {
+    return hasDuplicates(b) ? 0 :
+      !anyClash(b, seed, true, Offsets::first[b], Offsets::first[b + 1]) ? seed :
+      seed + 1 >= Params::SEED_FAILED ? Params::SEED_FAILED :
+      findSeed(b, seed + 1);
+  }
+
+  // True if any of buckets [lo, hi) contain duplicate keys
+  static constexpr bool duplicatesIn(const size_t lo, const size_t hi) {
+    return hi - lo == 0 ? false :
+      hi - lo == 1 ? hasDuplicates(lo) :
+      duplicatesIn(lo, (lo + hi) / 2) || duplicatesIn((lo + hi) / 2, hi);
+  }
+};
+
+// Stage 6: the seed for each bucket
+template <class Keys, class I = typename PerfectHashParams<Keys>::BucketIndices>
+struct PerfectHashSeeds;
+
+template <class Keys, size_t... B>
+struct PerfectHashSeeds<Keys, IndexSequence<B...>> {
+  static constexpr uint8_t seed[sizeof...(B) + 1] = {
+    PerfectHashBucket<Keys>::findSeed(B)..., 0 };
+
+  // True if all of buckets [lo, hi) have a seed
+  static constexpr bool seedsFound(const size_t lo, const size_t hi) {
+    return hi - lo == 0 ? true :
+      hi - lo == 1 ? seed[lo] != PerfectHashParams<Keys>::SEED_FAILED :
+      seedsFound(lo, (lo + hi) / 2) && seedsFound((lo + hi) / 2, hi);
+  }
+};
+
+template <class Keys, size_t... B>
+constexpr uint8_t PerfectHashSeeds<Keys, IndexSequence<B...>>::seed[];
+
+// Functions for filling the slots
+template <class Keys>
+struct PerfectHashSlot {
+  typedef PerfectHashParams<Keys> Params;
+  typedef PerfectHashBucket<Keys> Bucket;
+  typedef PerfectHashBucketSizes<Keys> Sizes;
+  typedef PerfectHashBucketOffsets<Keys> Offsets;
+
+  // Bucket which owns slot `slot`, searching buckets [lo, hi)
+  static constexpr size_t bucketOf(const size_t slot, const size_t lo, const size_t hi) {
+    return hi - lo == 1 ? lo :
+      Offsets::offset[(lo + hi) / 2] <= slot ? bucketOf(slot, (lo + hi) / 2, hi) :
+      bucketOf(slot, lo, (lo + hi) / 2);
+  }
+
+  // The key at sorted positions [lo, hi) which lands in `slot` of bucket `b`,
+  // or `numKeys` if there is none
+  static constexpr size_t keyIn(const size_t b, const size_t slot, const size_t lo, const size_t hi) {
+    return hi - lo == 0 ? Params::numKeys :
+      hi - lo == 1 ? (Params::slotOf(Bucket::hashAt(lo), PerfectHashSeeds<Keys>::seed[b],
+        Sizes::slots[b]) == slot ? PerfectHashSortedKeys<Keys>::key[lo] : Params::numKeys) :
+      keyIn(b, slot, lo, (lo + hi) / 2) != Params::numKeys ? keyIn(b, slot, lo, (lo + hi) / 2) :
+      keyIn(b, slot, (lo + hi) / 2, hi);
+  }
+
+  static constexpr size_t keyInBucket(const size_t b, const size_t slot) {
+    return keyIn(b, slot - Offsets::offset[b], Offsets::first[b], Offsets::first[b + 1]);
+  }
+
+  // Position in the list of the key in table slot `slot`
+  static constexpr size_t contents(const size_t slot) {
+    return keyInBucket(bucketOf(slot, 0, Params::numBuckets), slot);
+  }
+};
+
+// Type used to store positions in the list of keywords
+template <bool fitsInByte>
+struct PerfectHashIndex { typedef uint8_t type; };
+
+template <>
+struct PerfectHashIndex<false> { typedef uint16_t type; };
+
+template <class Keys, class BucketIndices, class SlotIndices, class KeyIndices>
+class PerfectHashTables;
+
+template <class Keys, size_t... B, size_t... S, size_t... K>
+class PerfectHashTables<Keys, IndexSequence<B...>, IndexSequence<S...>, IndexSequence<K...>> {
+
+  typedef PerfectHashParams<Keys> Params;
+  typedef PerfectHashBucketOffsets<Keys> Offsets;
+
+  static_assert(Params::numKeys > 0, "PerfectHash needs at least one keyword");
+  static_assert(!PerfectHashBucket<Keys>::duplicatesIn(0, Params::numBuckets),
+    "Duplicate keyword passed to PerfectHash");
+  static_assert(PerfectHashSeeds<Keys>::seedsFound(0, Params::numBuckets),
+    "PerfectHash could not separate the keywords");
+  static_assert(Offsets::numSlots <= 0xFFFF, "Too many keywords for PerfectHash");
+
+public:
+
+  // Type used to store a position in the list, or `numKeys` for an empty slot
+  typedef typename PerfectHashIndex<(Params::numKeys <= 0xFF)>::type index_t;
+
+  // Position in the list of the only keyword which could have this hash.
+  // The caller must check that the keyword's hash matches. Returns -1 if no
+  // keyword could have this hash
+  static int candidate(const uint32_t hash) {
+
+    const size_t b = Params::bucketOf(hash);
+    const uint16_t start = pgm_read_word(&_offsets[b]);
+    const uint16_t slots = pgm_read_word(&_offsets[b + 1]) - start;
+
+    if (slots == 0) return -1;
+
+    const uint8_t seed = pgm_read_byte(&_seeds[b]);
+    const size_t slot = start + Params::slotOf(hash, seed, slots);
+
+    index_t idx;
+    memcpy_P(&idx, &_slots[slot], sizeof(idx));
+
+    return idx == Params::numKeys ? -1 : idx;
+  }
+
+  // Position in the list of this hash, or -1 if it isn't there
+  static int find(const uint32_t hash) {
+
+    const int idx = candidate(hash);
+
+    if (idx < 0 || pgm_read_dword(&_hashes[idx]) != hash) return -1;
+
+    return idx;
+  }
+
+private:
+  static const uint16_t _offsets[sizeof...(B) + 1];
+  static const uint8_t _seeds[sizeof...(B)];
+  static const index_t _slots[sizeof...(S)];
+  static const uint32_t _hashes[sizeof...(K)];
+};
+
+template <class Keys, size_t... B, size_t... S, size_t... K>
+const uint16_t PerfectHashTables<Keys, IndexSequence<B...>, IndexSequence<S...>, IndexSequence<K...>>::
+  _offsets[sizeof...(B) + 1] PROGMEM = { PerfectHashBucketOffsets<Keys>::offset[B]...,
+    PerfectHashBucketOffsets<Keys>::numSlots };
+
+template <class Keys, size_t... B, size_t... S, size_t... K>
+const uint8_t PerfectHashTables<Keys, IndexSequence<B...>, IndexSequence<S...>, IndexSequence<K...>>::
+  _seeds[sizeof...(B)] PROGMEM = { PerfectHashSeeds<Keys>::seed[B]... };
+
+template <class Keys, size_t... B, size_t... S, size_t... K>
+const typename PerfectHashTables<Keys, IndexSequence<B...>, IndexSequence<S...>, IndexSequence<K...>>::index_t
+  PerfectHashTables<Keys, IndexSequence<B...>, IndexSequence<S...>, IndexSequence<K...>>::
+  _slots[sizeof...(S)] PROGMEM = { (index_t)PerfectHashSlot<Keys>::contents(S)... };
+
+template <class Keys, size_t... B, size_t... S, size_t... K>
+const uint32_t PerfectHashTables<Keys, IndexSequence<B...>, IndexSequence<S...>, IndexSequence<K...>>::
+  _hashes[sizeof...(K)] PROGMEM = { Keys::hash(K)... };
+
+// The perfect hash of the keywords in `Keys`. See the top of this file
+template <class Keys>
+class PerfectHash : public PerfectHashTables<Keys,
+  typename PerfectHashParams<Keys>::BucketIndices,
+  typename MakeIndexSequence<PerfectHashBucketOffsets<Keys>::numSlots>::type,
+  typename PerfectHashParams<Keys>::KeyIndices>
+{};
@@ -0,0 +1,88 @@
+#pragma once
+
+// This file implements the runtime versions of the case insensitive crc32
+// hash calculated by COMMANDHANDLER_HASH in compileTimeCrc32.h. They are used
+// to hash commands as they are received, so they all give identical results
+// to COMMANDHANDLER_HASH.
+//
+// The hash is calculated one char at a time: start with CRC32_INITIAL, pass
+// each char to crc32_update() and pass the result to crc32_final().
+//
+// Three implementations are provided, trading speed against flash:
+//
+//   crc32_update_bitwise()  8 shift/xor steps per char, no table
+//   crc32_update_nibble()   2 lookups per char in a 16 entry (64 byte) table
+//   crc32_update_table()    1 lookup per char in a 256 entry (1 KB) table
+//
+// crc32_update() uses the nibble table on AVR and the full table elsewhere.
+// To choose a different one, set one of these flags before including
+// CommandHandler.h:
+// #define COMMAND_CRC_BITWISE
+// #define COMMAND_CRC_NIBBLE_TABLE
+// #define COMMAND_CRC_BYTE_TABLE
+
+#include "compileTimeCrc32.h"
+
+#if !defined(COMMAND_CRC_BITWISE) && !defined(COMMAND_CRC_NIBBLE_TABLE) && !defined(COMMAND_CRC_BYTE_TABLE)
+#ifdef __AVR__
+#define COMMAND_CRC_NIBBLE_TABLE
+#else
+#define COMMAND_CRC_BYTE_TABLE
+#endif
+#endif
+
+// Starting value of the CRC register
+#define CRC32_INITIAL 0xFFFFFFFF
+
+// CRC32 nibble table (zlib polynomial), stored in flash
+static const uint32_t crc_nibble_table[16] PROGMEM = {
+  0x00000000L, 0x1db71064L, 0x3b6e20c8L, 0x26d930acL,
+  0x76dc4190L, 0x6b6b51f4L, 0x4db26158L, 0x5005713cL,
+  0xedb88320L, 0xf00f9344L, 0xd6d6a3e8L, 0xcb61b38cL,
+  0x9b64c2b0L, 0x86d3d2d4L, 0xa00ae278L, 0xbdbdf21cL
+};
+
+// Add a char to the crc by shifting it through the polynomial one bit at a
+// time. The byte reversal is avoided by shifting the crc reg right instead of
+// left and by using a reversed 32-bit word to represent the polynomial.
+inline uint32_t crc32_update_bitwise(uint32_t crc, const char c) {
+  crc ^= (uint8_t)tolower_const(c);
+
+  for (int j = 0; j < 8; j++) {
+    const uint32_t mask = -(crc & 1);
+    crc = (crc >> 1) ^ (0xEDB88320 & mask);
+  }
+
+  return crc;
+}
+
+// Add a char to the crc, four bits at a time
+inline uint32_t crc32_update_nibble(uint32_t crc, const char c) {
+  crc ^= (uint8_t)tolower_const(c);
+
+  crc = (crc >> 4) ^ pgm_read_dword(&crc_nibble_table[crc & 0x0F]);
+  crc = (crc >> 4) ^ pgm_read_dword(&crc_nibble_table[crc & 0x0F]);
+
+  return crc;
+}
+
+// Add a char to the crc using the same table as COMMANDHANDLER_HASH
+inline uint32_t crc32_update_table(uint32_t crc, const char c) {
+  return (crc >> 8) ^ pgm_read_dword(&crc_table[(crc ^ tolower_const(c)) & 0xFF]);
+}
+
+// Add a char to the crc using the selected implementation
+inline uint32_t crc32_update(uint32_t crc, const char c) {
+#if defined(COMMAND_CRC_BITWISE)
+  return crc32_update_bitwise(crc, c);
+#elif defined(COMMAND_CRC_NIBBLE_TABLE)
+  return crc32_update_nibble(crc, c);
+#else
+  return crc32_update_table(crc, c);
+#endif
+}
+
+// Finish a crc to give the hash
+inline uint32_t crc32_final(uint32_t crc) {
+  return ~crc;
+}
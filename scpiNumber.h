@@ -0,0 +1,244 @@
+#pragma once
+
+// This file implements a parser for SCPI numeric parameters, e.g.
+//
+//     ScpiNumber volts;
+//     if (parseScpiNumber(params[1], volts, "V") != CommandHandlerReturn::NO_ERROR) { ... }
+//
+//     int32_t millivolts;
+//     volts.toFixed(3, millivolts);
+//
+// It accepts:
+//
+//   Decimal numbers     "1", "-2.5", "1.5E-3" (SCPI's NR1, NR2 and NR3)
+//   Units               "100mV", "2.4kHz", "5V" if `unit` is given. The unit may
+//                       follow a multiplier: EX, PE, T, G, MA (mega), K, M
+//                       (milli), U, N, P, F or A. As in SCPI, these are case
+//                       insensitive, except that MHZ and MOHM mean mega
+//   Special values      MINimum, MAXimum, DEFault, INFinity, NINF and NAN
+//
+// The string is read once, without using the C library, and the number is
+// kept as a decimal mantissa and exponent. It can then be converted either to
+// a float or, without any float maths, to an integer in units of 10^-scale,
+// e.g. "100mV" with a scale of 3 gives 100. Only the first 9 significant
+// digits are used.
+
+#include <math.h>
+
+#include "CommandHandler.h"
+#include "parameterParsing.h"
+
+// The kinds of value a SCPI number can have
+enum class ScpiNumberKind {
+  NUMBER,
+  MINIMUM,
+  MAXIMUM,
+  DEFAULT_VALUE,
+  POSITIVE_INFINITY,
+  NEGATIVE_INFINITY,
+  NOT_A_NUMBER
+};
+
+// A parsed SCPI number, equal to mantissa * 10^exponent if `kind` is NUMBER
+struct ScpiNumber {
+  ScpiNumberKind kind;
+  int32_t mantissa;
+  int16_t exponent;
+
+  // Is this a number, rather than one of the special values?
+  bool isNumber() const { return kind == ScpiNumberKind::NUMBER; }
+
+  // The value as a float. The infinities and NAN are converted, but the
+  // other special values give 0
+  float toFloat() const {
+
+    switch (kind) {
+    case ScpiNumberKind::NUMBER:
+      return (mantissa < 0 ? -1 : 1) *
+        parseScale<float>(mantissa < 0 ? -mantissa : mantissa, exponent);
+    case ScpiNumberKind::POSITIVE_INFINITY:
+      return INFINITY;
+    case ScpiNumberKind::NEGATIVE_INFINITY:
+      return -INFINITY;
+    case ScpiNumberKind::NOT_A_NUMBER:
+      return NAN;
+    default:
+      return 0;
+    }
+  }
+
+  // The value in units of 10^-scale, rounded to the nearest integer, e.g. a
+  // scale of 3 gives thousandths. Returns INVALID_PARAMETER if this is not a
+  // number or doesn't fit in an int32_t
+  CommandHandlerReturn toFixed(int scale, int32_t& result) const {
+
+    if (!isNumber()) return CommandHandlerReturn::INVALID_PARAMETER;
+
+    uint32_t value = mantissa < 0 ? -mantissa : mantissa;
+    int e = exponent + scale;
+
+    for (; e > 0; e--) {
+      if (value > INT32_MAX / 10) return CommandHandlerReturn::INVALID_PARAMETER;
+      value *= 10;
+    }
+
+    if (e < 0) {
+      // The mantissa has at most 9 digits, so dividing by more than 10^9
+      // always rounds to 0
+      if (e < -9) {
+        value = 0;
+      }
+      else {
+        uint32_t divisor = 1;
+        for (; e < 0; e++) divisor *= 10;
+
+        value = (value + divisor / 2) / divisor;
+      }
+    }
+
+    result = mantissa < 0 ? -(int32_t)value : (int32_t)value;
+    return CommandHandlerReturn::NO_ERROR;
+  }
+};
+
+// Upper case version of a char
+inline char scpiUpper(const char c) {
+  return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+// Does `str` equal the first `shortLength` chars of `mnemonic`, or the whole
+// of it? `mnemonic` must be upper case
+inline bool scpiMatchMnemonic(const char* str, const char* mnemonic, size_t shortLength) {
+
+  size_t i = 0;
+
+  while (str[i] && mnemonic[i] && scpiUpper(str[i]) == mnemonic[i]) i++;
+
+  return str[i] == '\0' && (i == shortLength || mnemonic[i] == '\0');
+}
+
+// A SCPI unit multiplier, e.g. "K" for 10^3
+struct ScpiMultiplier {
+  char prefix[3];
+  int8_t exponent;
+};
+
+// Longer prefixes come first, so that "MA" is tried before "M"
+static const ScpiMultiplier scpi_multipliers[] PROGMEM = {
+  { "EX", 18 }, { "PE", 15 }, { "MA", 6 }, { "T", 12 }, { "G", 9 },
+  { "K", 3 }, { "M", -3 }, { "U", -6 }, { "N", -9 }, { "P", -12 },
+  { "F", -15 }, { "A", -18 }
+};
+
+// Find the power of 10 given by the suffix of a number. The suffix must be
+// the unit, optionally following a multiplier. Returns false if it isn't
+inline bool scpiParseSuffix(const char* suffix, const char* unit, int& exponent) {
+
+  if (parseMatchWord(suffix, unit)) {
+    exponent = 0;
+    return true;
+  }
+
+  // SCPI's exceptions to the multipliers
+  if ((parseMatchWord(unit, "HZ") && parseMatchWord(suffix, "MHZ")) ||
+    (parseMatchWord(unit, "OHM") && parseMatchWord(suffix, "MOHM"))) {
+    exponent = 6;
+    return true;
+  }
+
+  for (size_t i = 0; i < sizeof(scpi_multipliers) / sizeof(ScpiMultiplier); i++) {
+
+    ScpiMultiplier m;
+    memcpy_P(&m, &scpi_multipliers[i], sizeof(ScpiMultiplier));
+
+    size_t length = 0;
+    while (m.prefix[length] && scpiUpper(suffix[length]) == m.prefix[length]) length++;
+
+    if (m.prefix[length] == '\0' && parseMatchWord(suffix + length, unit)) {
+      exponent = m.exponent;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Parse a SCPI numeric parameter into `result`. If `unit` (in upper case, e.g.
+// "V" or "HZ") is given, the number may be followed by it. Returns
+// INVALID_PARAMETER if `str` is not a valid number
+inline CommandHandlerReturn parseScpiNumber(const char* str, ScpiNumber& result,
+  const char* unit = NULL) {
+
+  if (!str) return CommandHandlerReturn::INVALID_PARAMETER;
+
+  ScpiNumber number;
+  number.kind = ScpiNumberKind::NUMBER;
+  number.mantissa = 0;
+  number.exponent = 0;
+
+  // Special values start with a letter
+  if (scpiUpper(*str) >= 'A' && scpiUpper(*str) <= 'Z') {
+
+    if (scpiMatchMnemonic(str, "MINIMUM", 3))
+      number.kind = ScpiNumberKind::MINIMUM;
+    else if (scpiMatchMnemonic(str, "MAXIMUM", 3))
+      number.kind = ScpiNumberKind::MAXIMUM;
+    else if (scpiMatchMnemonic(str, "DEFAULT", 3))
+      number.kind = ScpiNumberKind::DEFAULT_VALUE;
+    else if (scpiMatchMnemonic(str, "INFINITY", 3))
+      number.kind = ScpiNumberKind::POSITIVE_INFINITY;
+    else if (parseMatchWord(str, "NINF"))
+      number.kind = ScpiNumberKind::NEGATIVE_INFINITY;
+    else if (parseMatchWord(str, "NAN"))
+      number.kind = ScpiNumberKind::NOT_A_NUMBER;
+    else
+      return CommandHandlerReturn::INVALID_PARAMETER;
+
+    result = number;
+    return CommandHandlerReturn::NO_ERROR;
+  }
+
+  const bool negative = parseSign(str);
+
+  uint32_t mantissa;
+  int exponent;
+
+  if (!parseMantissa(str, mantissa, exponent))
+    return CommandHandlerReturn::INVALID_PARAMETER;
+
+  // An 'E' starts an exponent if digits follow, otherwise it may be the
+  // start of a unit, e.g. "1EXV"
+  if (scpiUpper(*str) == 'E') {
+
+    const char* exponentStr = str + 1;
+    const bool negativeExponent = parseSign(exponentStr);
+    unsigned long exponentValue;
+
+    if (parseDigits(exponentStr, 9999, exponentValue)) {
+      exponent += negativeExponent ? -(int)exponentValue : (int)exponentValue;
+      str = exponentStr;
+    }
+  }
+
+  // Anything left must be the unit
+  if (*str) {
+
+    int multiplier;
+
+    if (!unit || !scpiParseSuffix(str, unit, multiplier))
+      return CommandHandlerReturn::INVALID_PARAMETER;
+
+    exponent += multiplier;
+  }
+
+  number.mantissa = negative ? -(int32_t)mantissa : (int32_t)mantissa;
+  number.exponent = exponent;
+
+  result = number;
+  return CommandHandlerReturn::NO_ERROR;
+}
+
+// Allow typed commands (see typedCommand.h) to take SCPI numbers, without units
+inline bool parseParam(const char* str, ScpiNumber& result) {
+  return parseScpiNumber(str, result) == CommandHandlerReturn::NO_ERROR;
+}
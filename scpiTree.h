@@ -0,0 +1,227 @@
+#pragma once
+
+// This file implements a hierarchical SCPI command tree. Commands such as
+// ":SOURce:VOLTage 1" are resolved one colon separated level at a time, with
+// each level looked up among the children of the level before, e.g.
+//
+//     const ScpiNode sourceNodes[] PROGMEM = {
+//       SCPI_COMMAND("VOLTage", 1, &setVoltage),
+//       SCPI_COMMAND("VOLTage?", 0, &getVoltage),
+//       SCPI_COMMAND("CURRent", 1, &setCurrent)
+//     };
+//
+//     const ScpiNode rootNodes[] PROGMEM = {
+//       SCPI_COMMAND("*IDN?", 0, &identify),
+//       SCPI_BRANCH("SOURce", sourceNodes)
+//     };
+//
+// Children must be declared before their parents. The whole tree is stored in
+// flash, so it costs no RAM however deep it is.
+//
+// Mnemonics are written in SCPI's mixed case form: each node matches both its
+// long form ("VOLTage") and its short form, which is the upper case part
+// ("VOLT"), in any case. Both hashes are calculated by the compiler. A mnemonic
+// with no upper case letters, e.g. "volt", only has one form.
+//
+// The path of the last command is remembered, following SCPI's rules for
+// compound commands: in ":SOUR:VOLT 1;CURR 2" the second header doesn't start
+// with a colon, so CURR is looked up among the children of SOUR without hashing
+// SOUR again. A header starting with a colon is looked up from the root.
+// Common commands (starting with '*') are always looked up from the root and
+// don't change the path. The path is reset to the root by `reset()`, which
+// CommandHandler calls at the end of each line.
+//
+// Each level is found by comparing the hash of its mnemonic against both forms
+// of its siblings in turn, so keep the number of children per node small.
+
+#include "runtimeCrc32.h"
+
+// These are defined in CommandHandler.h
+class ParameterLookup;
+typedef void commandFunction(const ParameterLookup& params);
+
+// A node of the command tree. A node can be a command, a branch or both, e.g.
+// for ":SOURce:VOLTage" and ":SOURce:VOLTage:RANGe"
+struct ScpiNode {
+  uint32_t hash; // Hash of this level's mnemonic (case insensitive)
+  uint32_t shortHash; // Hash of the short form of the mnemonic
+  int8_t n; // Number of params the command takes, or -1 for any number
+  commandFunction* f; // Function to call, or NULL if this is only a branch
+  const ScpiNode* children; // Array of child nodes in flash, or NULL
+  uint8_t numChildren;
+};
+
+// Number of nodes in an array of ScpiNodes
+#define SCPI_NUM_NODES(nodes) (sizeof(nodes) / sizeof(ScpiNode))
+
+// A command with no children, given the mnemonic, the number of params and the
+// function
+#define SCPI_COMMAND(mnemonic, ...) \
+  { (uint32_t)COMMANDHANDLER_HASH(mnemonic), (uint32_t)COMMANDHANDLER_SHORT_HASH(mnemonic), \
+    __VA_ARGS__, NULL, 0 }
+
+// A branch with no command of its own
+#define SCPI_BRANCH(mnemonic, children) \
+  { (uint32_t)COMMANDHANDLER_HASH(mnemonic), (uint32_t)COMMANDHANDLER_SHORT_HASH(mnemonic), \
+    -1, NULL, children, SCPI_NUM_NODES(children) }
+
+// A command which also has children
+#define SCPI_COMMAND_BRANCH(mnemonic, n, f, children) \
+  { (uint32_t)COMMANDHANDLER_HASH(mnemonic), (uint32_t)COMMANDHANDLER_SHORT_HASH(mnemonic), \
+    n, f, children, SCPI_NUM_NODES(children) }
+
+// This class resolves the headers of received commands in a tree of ScpiNodes.
+// Chars of each header are passed to `addChar()` as they are received, then
+// `endHeader()` returns the node that was found.
+class ScpiPath {
+
+public:
+
+  ScpiPath() :
+    _root(NULL), _rootSize(0)
+  {
+    reset();
+  }
+
+  // Set the root nodes of the tree. `root` must point to an array in flash
+  void setRoot(const ScpiNode* root, uint8_t rootSize) {
+    _root = root;
+    _rootSize = rootSize;
+    reset();
+  }
+
+  // Has a tree been set?
+  bool hasTree() const { return _root != NULL; }
+
+  // Copy a node out of flash into `result`. Returns false if `node` is NULL
+  static bool readNode(const ScpiNode* node, ScpiNode& result) {
+
+    if (!node) return false;
+
+    memcpy_P(&result, node, sizeof(ScpiNode));
+    return true;
+  }
+
+  // Return to the root of the tree, e.g. at the end of a line
+  void reset() {
+    _current = _root;
+    _currentSize = _rootSize;
+    startHeader();
+  }
+
+  // Add the next char of the header
+  void addChar(const char c) {
+
+    if (_failed) return;
+
+    const bool firstChar = !_started;
+    _started = true;
+
+    if (c == ':') {
+
+      if (firstChar) {
+        // A leading colon means this header starts from the root
+        _search = _root;
+        _searchSize = _rootSize;
+        return;
+      }
+
+      // This level is complete, so move down to its children
+      ScpiNode node;
+
+      if (!readNode(findLevel(), node) || !node.children) {
+        _failed = true;
+        return;
+      }
+
+      _search = node.children;
+      _searchSize = node.numChildren;
+      _levelCrc = CRC32_INITIAL;
+      _levelLength = 0;
+    }
+    else {
+
+      if (firstChar && c == '*') {
+        // A common command, which is looked up from the root
+        _common = true;
+        _search = _root;
+        _searchSize = _rootSize;
+      }
+
+      _levelCrc = crc32_update(_levelCrc, c);
+      _levelLength++;
+    }
+  }
+
+  // The header is complete, so find its node. Returns a pointer to the node
+  // in flash, or NULL if the header is not a command
+  const ScpiNode* endHeader() {
+
+    const ScpiNode* found = _failed ? NULL : findLevel();
+    ScpiNode node;
+
+    if (!readNode(found, node) || !node.f) found = NULL;
+
+    // Later headers are relative to the parent of this one
+    if (found && !_common) {
+      _current = _search;
+      _currentSize = _searchSize;
+    }
+
+    startHeader();
+
+    return found;
+  }
+
+private:
+
+  // Prepare for a new header, relative to the current path
+  void startHeader() {
+    _search = _current;
+    _searchSize = _currentSize;
+    _levelCrc = CRC32_INITIAL;
+    _levelLength = 0;
+    _started = false;
+    _failed = false;
+    _common = false;
+  }
+
+  // Look up the level that has just been received among the nodes being
+  // searched. Returns NULL if it isn't there
+  const ScpiNode* findLevel() const {
+
+    if (_levelLength == 0) return NULL;
+
+    const uint32_t hash = crc32_final(_levelCrc);
+
+    for (uint8_t i = 0; i < _searchSize; i++) {
+
+      if (pgm_read_dword(&_search[i].hash) == hash ||
+        pgm_read_dword(&_search[i].shortHash) == hash) {
+        return _search + i;
+      }
+    }
+
+    return NULL;
+  }
+
+  // The top level of the tree
+  const ScpiNode* _root;
+  uint8_t _rootSize;
+
+  // Nodes which headers without a leading colon are looked up in
+  const ScpiNode* _current;
+  uint8_t _currentSize;
+
+  // Nodes which the current level of the header is looked up in
+  const ScpiNode* _search;
+  uint8_t _searchSize;
+
+  // Hash and length of the current level so far
+  uint32_t _levelCrc;
+  uint8_t _levelLength;
+
+  bool _started; // Has any of the header been received?
+  bool _failed; // Has a level of the header not been found?
+  bool _common; // Is this a common command?
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+// This file lets commands be written as ordinary functions with typed
+// parameters, instead of taking a ParameterLookup and converting the
+// parameters themselves, e.g.
+//
+//     void setVoltage(int channel, float volts) { ... }
+//
+//     h.registerCommand(COMMANDHANDLER_HASH("volt"), TYPED_COMMAND(setVoltage));
+//
+// TYPED_COMMAND(f) expands to the number of parameters that f takes, followed
+// by a commandFunction which converts each parameter with `parseParam()` (see
+// parameterParsing.h) and then calls f. If a parameter can't be converted, f is
+// not called and `executeCommand()` returns INVALID_PARAMETER.
+//
+// It can be used wherever a number of parameters and a commandFunction are
+// expected, e.g. COMMAND_ENTRY("volt", TYPED_COMMAND(setVoltage)).
+//
+// Parameters may be int, unsigned int, long, unsigned long, float, double,
+// bool or const char*. To support another type, add a `parseParam()` overload
+// for it.
+
+#include "CommandHandler.h"
+#include "parameterParsing.h"
+
+// Strip const and & from a parameter type, to get the type to convert to
+template <class T> struct TypedParam { typedef T type; };
+template <class T> struct TypedParam<const T> { typedef T type; };
+template <class T> struct TypedParam<T&> { typedef T type; };
+template <class T> struct TypedParam<const T&> { typedef T type; };
+
+// Convert the parameters for the types `Remaining` one at a time, starting
+// with parameter `idx`, then call `f` with all of them
+template <class... Remaining>
+struct TypedArgs;
+
+template <>
+struct TypedArgs<> {
+
+	template <class F, class... Converted>
+	static void call(F f, const ParameterLookup&, int, Converted... converted) {
+		f(converted...);
+	}
+};
+
+template <class T, class... Rest>
+struct TypedArgs<T, Rest...> {
+
+	template <class F, class... Converted>
+	static void call(F f, const ParameterLookup& params, int idx, Converted... converted) {
+
+		typename TypedParam<T>::type value;
+
+		if (!parseParam(params[idx], value)) {
+			CONSOLE_LOG(F("TypedCommand::Invalid parameter "));
+			CONSOLE_LOG_LN(idx);
+
+			params.setError(CommandHandlerReturn::INVALID_PARAMETER);
+			return;
+		}
+
+		TypedArgs<Rest...>::call(f, params, idx + 1, converted..., value);
+	}
+};
+
+// A commandFunction which calls the typed function `f`
+template <class F, F f>
+struct TypedCommand;
+
+template <class... Args, void (*f)(Args...)>
+struct TypedCommand<void (*)(Args...), f> {
+
+	// Number of parameters the command takes
+	static const int numParams = sizeof...(Args);
+
+	static void call(const ParameterLookup& params) {
+		TypedArgs<Args...>::call(f, params, 1);
+	}
+};
+
+// The number of parameters and the commandFunction for the typed function `f`
+#define TYPED_COMMAND(f) \
+	TypedCommand<decltype(&f), &f>::numParams, &TypedCommand<decltype(&f), &f>::call